@@ -36,6 +36,10 @@ typedef enum {
     OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_CALL,
+    // Call that reuses the frame of the caller, followed by a return in case the callee cannot reuse it.
+    OP_TAIL_CALL,
+    // Call whose result is popped right away, async callees run without a promise.
+    OP_SPAWN,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
@@ -53,7 +57,30 @@ typedef enum {
     OP_ARRAY_GET,
     OP_ARRAY_SET,
     OP_ARRAY_INCR,
-    OP_ARRAY_DECR
+    OP_ARRAY_DECR,
+    // Superinstructions fused by the compiler's peephole stage.
+    OP_GET_LOCAL2,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_GET_LOCAL_FIELD,
+    // Comparisons fused with the conditional jump that follows them, they pop both operands.
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_EQUAL,
+    // Increments the counter of a counted loop and loops back while it is less than the limit on the stack.
+    OP_FOR_LOOP,
+    // Array accesses indexed by a loop counter that is known to be a non-negative integer.
+    OP_ARRAY_GET_COUNTER,
+    OP_ARRAY_SET_COUNTER,
+    // Type-specialized variants that the VM rewrites generic instructions to once it has seen their operands.
+    // They are never emitted by the compiler and go back to the generic instruction when their guard fails.
+    OP_EQUAL_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STRING,
+
+    OP_COUNT
 } OpCode;
 
 typedef struct {
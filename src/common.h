@@ -6,12 +6,28 @@
 #include <stdint.h>
 
 #define UNUSED(parameter) __attribute__((unused)) parameter##_UNUSED
+// Rarely taken slow paths, kept out of line so they don't burden their callers' fast paths.
+#define COLD __attribute__((cold, noinline))
 
 // #define DEBUG_PRINT_BYTECODE
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_INLINE_CACHE_STATS
 
 #define INLINE_CACHING
 
+// Pack values into 64 bits using the payload of quiet NaNs instead of a 16 byte tagged union.
+#define NAN_BOXING
+
+// Dispatch instructions through a table of label addresses (GNU C extension) instead of a switch.
+#ifdef __GNUC__
+#define COMPUTED_GOTO
+#endif
+
+// Run socket operations through io_uring, falling back to epoll at runtime on kernels without it (Linux only).
+#ifdef __linux__
+#define IO_URING
+#endif
+
 #endif  // CLOX_COMMON_H_
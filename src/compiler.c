@@ -62,12 +62,46 @@ typedef struct {
     uint8_t index;
 } Upvalue;
 
-// Contains instruction to which break/continue should jump (using loop).
-typedef struct {
+#define COUNTER_INDEXES_MAX 64
+// Empty chain of jumps, no operand is at offset 0.
+#define NO_JUMPS 0
+// Continue of counted loops jumps forward to the loop instruction emitted after the body.
+#define CONTINUE_FORWARD UINT32_MAX
+#define NO_COUNTER -1
+
+// Contains instruction to which continue should jump (using loop), and chains of jumps to patch at the end of the loop.
+typedef struct Loop {
+    struct Loop *enclosing;
     uint32_t continue_loop;
-    uint32_t break_loop;
+    // Locals deeper than this are declared in the loop body and have to be popped when jumping out of it.
+    int scope_depth;
+    uint32_t breaks;
+    uint32_t continues;
+    // Slot of the counter of a counted loop that starts at a non-negative integer, array accesses indexed by it
+    // skip the index check unless the body writes or captures the counter.
+    int counter;
+    bool counter_written;
+    uint32_t counter_indexes_count;
+    uint32_t counter_indexes[COUNTER_INDEXES_MAX];
 } Loop;
 
+// Loop `for (...; counter < limit; counter++)` whose update and condition are done by a single instruction after
+// the body. The limit is a constant or a variable, and its load is repeated before that instruction.
+typedef struct {
+    uint8_t counter;
+    uint8_t limit[3];
+    uint32_t limit_length;
+    Loc limit_loc;
+    Loc update_loc;
+} CountedLoop;
+
+// Jump over code that runs only if a condition is true. Comparisons right before it are fused into the jump,
+// which then pops the operands, otherwise the condition is popped on both paths.
+typedef struct {
+    uint32_t offset;
+    bool fused;
+} ConditionJump;
+
 typedef struct Compiler {
     struct Compiler *enclosing;
     FunctionType function_type;
@@ -77,6 +111,10 @@ typedef struct Compiler {
     uint32_t locals_count;
     Local locals[LOCALS_SIZE];
     Upvalue upvalues[UPVALUES_SIZE];
+    // Offsets of the last two instructions that may begin a superinstruction, the older one first.
+    uint32_t fusable_instrs[2];
+    // Instructions can only be fused if no jump lands between them.
+    uint32_t last_jump_target;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -143,6 +181,9 @@ static Chunk *current_chunk(void) { return &c->function->chunk; }
 
 static uint32_t current_offset(void) { return current_chunk()->length; }
 
+// Returns the current offset, which a jump is going to land on.
+static uint32_t jump_target(void) { return c->last_jump_target = current_offset(); }
+
 static uint8_t add_constant(Value constant) {
     stack_push(constant);
     uint32_t index = push_constant(current_chunk(), constant);
@@ -160,6 +201,16 @@ static uint8_t identifier_constant(Token token) {
     return add_constant(VALUE_OBJECT(copy_string(token.start, token.length)));
 }
 
+static uint16_t resolve_global(Token token) {
+    uint32_t slot = global_slot(copy_string(token.start, token.length));
+    if (slot > UINT16_MAX) {
+        error_prev("Too many global variables");
+        return 0;
+    }
+
+    return slot;
+}
+
 static void emit_byte(uint8_t byte) { push_byte(current_chunk(), byte, p.previous.loc); }
 static void emit_byte2(uint8_t byte1, uint8_t byte2) {
     emit_byte(byte1);
@@ -174,7 +225,77 @@ static void emit_byte3(uint8_t byte1, uint8_t byte2, uint8_t byte3) {
 static void emit_byte_n(uint8_t byte, uint32_t count) { push_byte_n(current_chunk(), byte, count, p.previous.loc); }
 #endif
 
-static void emit_constant(Value constant) { emit_byte2(OP_CONSTANT, add_constant(constant)); }
+// Local and upvalue operands are a byte, global slots take 16 bits.
+static void emit_var(uint8_t opcode, uint16_t operand) {
+    if (opcode == OP_GET_GLOBAL || opcode == OP_SET_GLOBAL || opcode == OP_DEFINE_GLOBAL) {
+        emit_byte3(opcode, operand & 0xFF, operand >> 8);
+    } else {
+        emit_byte2(opcode, operand);
+    }
+}
+
+// Peephole stage: instructions that may begin a superinstruction are recorded when emitted, and emitters of the
+// instructions that may follow them rewrite the recorded ones in place instead of emitting a separate instruction.
+static void record_fusable_instr(void) {
+    c->fusable_instrs[0] = c->fusable_instrs[1];
+    c->fusable_instrs[1] = current_offset();
+}
+
+// Whether `opcode` of `length` bytes is at `start`, right before `end`, and no jump lands after its start.
+static bool is_fusable(uint32_t start, uint8_t opcode, uint32_t length, uint32_t end) {
+    return start + length == end && current_chunk()->code[start] == opcode && c->last_jump_target <= start;
+}
+
+// Drops the code emitted from `length` on. The recorded instructions may have been in it, so nothing before `length`
+// is fused anymore.
+static void truncate_chunk(uint32_t length) {
+    current_chunk()->length = length;
+    c->fusable_instrs[0] = c->fusable_instrs[1] = length;
+    c->last_jump_target = length;
+}
+
+static void emit_constant(Value constant) {
+    uint8_t index = add_constant(constant);
+    record_fusable_instr();
+    emit_byte2(OP_CONSTANT, index);
+}
+
+static void emit_get_local(uint8_t slot) {
+    uint32_t last = c->fusable_instrs[1];
+    if (is_fusable(last, OP_GET_LOCAL, 2, current_offset())) {
+        current_chunk()->code[last] = OP_GET_LOCAL2;
+        emit_byte(slot);
+        return;
+    }
+
+    record_fusable_instr();
+    emit_byte2(OP_GET_LOCAL, slot);
+}
+
+static void emit_add(void) {
+    uint32_t local = c->fusable_instrs[0];
+    uint32_t constant = c->fusable_instrs[1];
+    if (is_fusable(constant, OP_CONSTANT, 2, current_offset()) && is_fusable(local, OP_GET_LOCAL, 2, constant)) {
+        Chunk *chunk = current_chunk();
+        chunk->code[local] = OP_ADD_LOCAL_CONSTANT;
+        chunk->code[local + 2] = chunk->code[constant + 1];
+        // Runtime errors are reported at the last byte read, which is now the constant operand.
+        chunk->locs[local + 2] = p.previous.loc;
+        chunk->length--;
+        // The constant's offset is inside the new instruction now.
+        c->fusable_instrs[1] = local;
+        return;
+    }
+
+    emit_byte(OP_ADD);
+}
+
+// Comparisons may be fused into a conditional jump that follows them.
+static void emit_compare(uint8_t compare, bool negate) {
+    record_fusable_instr();
+    emit_byte(compare);
+    if (negate) emit_byte(OP_NOT);
+}
 
 static void emit_pop(uint8_t n) {
     if (n == 1) {
@@ -194,11 +315,75 @@ static uint32_t emit_jump(uint8_t jump_op) {
 
 static void patch_jump(uint32_t offset) {
     // -2 adjusts for the 16-bit jump operand that is already skipped.
-    uint32_t jump = current_offset() - offset - 2;
+    uint32_t jump = jump_target() - offset - 2;
     if (jump > UINT16_MAX) error_at(current_chunk()->locs[offset], "Jump target is too far");
     memcpy(current_chunk()->code + offset, &jump, sizeof(uint16_t));
 }
 
+// Emits a jump that is patched together with the jumps of `chain`, and returns the new chain. Until then its operand
+// holds the distance back to the previous jump of the chain, or 0 if it is the first.
+static uint32_t emit_chained_jump(uint32_t chain) {
+    uint32_t offset = emit_jump(OP_JUMP);
+    uint16_t distance = 0;
+    if (chain != NO_JUMPS) {
+        // The previous jump would have to go even further, past this one.
+        if (offset - chain > UINT16_MAX) error_at(current_chunk()->locs[chain], "Jump target is too far");
+        else distance = (uint16_t) (offset - chain);
+    }
+    memcpy(current_chunk()->code + offset, &distance, sizeof(uint16_t));
+    return offset;
+}
+
+static void patch_jumps(uint32_t chain) {
+    while (chain != NO_JUMPS) {
+        uint16_t distance;
+        memcpy(&distance, current_chunk()->code + chain, sizeof(uint16_t));
+        patch_jump(chain);
+        chain = distance == 0 ? NO_JUMPS : chain - distance;
+    }
+}
+
+static ConditionJump emit_condition_jump(void) {
+    static const struct {
+        uint8_t compare;
+        bool negated;
+        uint8_t jump;
+    } fused_jumps[] = {
+        {OP_LESS, false, OP_JUMP_IF_NOT_LESS},
+        {OP_GREATER, false, OP_JUMP_IF_NOT_GREATER},
+        {OP_EQUAL, false, OP_JUMP_IF_NOT_EQUAL},
+        {OP_LESS, true, OP_JUMP_IF_LESS},
+        {OP_GREATER, true, OP_JUMP_IF_GREATER},
+        {OP_EQUAL, true, OP_JUMP_IF_EQUAL},
+    };
+
+    Chunk *chunk = current_chunk();
+    uint32_t last = c->fusable_instrs[1];
+    for (size_t i = 0; i < sizeof(fused_jumps) / sizeof(*fused_jumps); i++) {
+        uint32_t length = fused_jumps[i].negated ? 2 : 1;
+        if (!is_fusable(last, fused_jumps[i].compare, length, current_offset())) continue;
+        if (fused_jumps[i].negated && chunk->code[last + 1] != OP_NOT) continue;
+
+        // Runtime errors of the comparison are reported at the jump now.
+        Loc loc = chunk->locs[last];
+        truncate_chunk(last);
+        push_byte(chunk, fused_jumps[i].jump, loc);
+        uint32_t offset = current_offset();
+        push_byte(chunk, 0xFF, loc);
+        push_byte(chunk, 0xFF, loc);
+        return (ConditionJump) {.offset = offset, .fused = true};
+    }
+
+    uint32_t offset = emit_jump(OP_JUMP_IF_FALSE);
+    emit_byte(OP_POP);
+    return (ConditionJump) {.offset = offset, .fused = false};
+}
+
+static void patch_condition_jump(ConditionJump jump) {
+    patch_jump(jump.offset);
+    if (!jump.fused) emit_byte(OP_POP);
+}
+
 // Emits a loop (jump back) instruction that goes back to `loop_start`.
 static void emit_loop(uint32_t loop_start) {
     emit_byte(OP_LOOP);
@@ -312,9 +497,17 @@ static int resolve_upvalue(Compiler *c, Token name) {
     return -1;
 }
 
+// Counters written in the loop body may no longer be non-negative integers.
+static void write_local(uint8_t slot) {
+    for (Loop *loop = c->loop; loop != NULL; loop = loop->enclosing) {
+        if (loop->counter == slot) loop->counter_written = true;
+    }
+}
+
 static void named_var(Token token, bool can_assign) {
     int index;
-    uint8_t get_op, set_op, operand;
+    uint8_t get_op, set_op;
+    uint16_t operand;
     if ((index = resolve_local(c, token)) != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
@@ -326,24 +519,29 @@ static void named_var(Token token, bool can_assign) {
     } else {
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
-        operand = identifier_constant(token);
+        operand = resolve_global(token);
     }
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_byte2(set_op, operand);
+        if (set_op == OP_SET_LOCAL) write_local(operand);
+        emit_var(set_op, operand);
     } else if (match(TOKEN_PLUS_PLUS)) {
-        emit_byte2(get_op, operand);
+        if (set_op == OP_SET_LOCAL) write_local(operand);
+        emit_var(get_op, operand);
         emit_byte(OP_INCR);
-        emit_byte2(set_op, operand);
+        emit_var(set_op, operand);
         emit_byte(OP_DECR);
     } else if (match(TOKEN_MINUS_MINUS)) {
-        emit_byte2(get_op, operand);
+        if (set_op == OP_SET_LOCAL) write_local(operand);
+        emit_var(get_op, operand);
         emit_byte(OP_DECR);
-        emit_byte2(set_op, operand);
+        emit_var(set_op, operand);
         emit_byte(OP_INCR);
+    } else if (get_op == OP_GET_LOCAL) {
+        emit_get_local(operand);
     } else {
-        emit_byte2(get_op, operand);
+        emit_var(get_op, operand);
     }
 }
 
@@ -475,16 +673,16 @@ static void binary(UNUSED(bool can_assign)) {
     parse_precedence(get_rule(op)->precedence + 1);
 
     switch (op) {
-        case TOKEN_PLUS:          emit_byte(OP_ADD); break;
+        case TOKEN_PLUS:          emit_add(); break;
         case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
         case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
         case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
-        case TOKEN_BANG_EQUAL:    emit_byte2(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emit_byte2(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emit_byte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emit_byte2(OP_GREATER, OP_NOT); break;
+        case TOKEN_BANG_EQUAL:    emit_compare(OP_EQUAL, true); break;
+        case TOKEN_EQUAL_EQUAL:   emit_compare(OP_EQUAL, false); break;
+        case TOKEN_GREATER:       emit_compare(OP_GREATER, false); break;
+        case TOKEN_GREATER_EQUAL: emit_compare(OP_LESS, true); break;
+        case TOKEN_LESS:          emit_compare(OP_LESS, false); break;
+        case TOKEN_LESS_EQUAL:    emit_compare(OP_GREATER, true); break;
         default:                  UNREACHABLE();
     }
 }
@@ -522,15 +720,52 @@ static void conditional(UNUSED(bool can_assign)) {
     patch_jump(jump_over_else);
 }
 
-static void call(UNUSED(bool can_assign)) { emit_byte2(OP_CALL, args()); }
+static void call(UNUSED(bool can_assign)) {
+    uint8_t arg_num = args();
+    // Calls right before a return become tail calls.
+    record_fusable_instr();
+    emit_byte2(OP_CALL, arg_num);
+}
+
+// Returns the innermost loop whose counter is the index just emitted, or NULL.
+static Loop *index_counter_loop(uint32_t index_start) {
+    Chunk *chunk = current_chunk();
+    uint32_t last = c->fusable_instrs[1];
+    int slot;
+    if (last == index_start && is_fusable(last, OP_GET_LOCAL, 2, current_offset())) {
+        slot = chunk->code[last + 1];
+    } else if (last + 2 == index_start && is_fusable(last, OP_GET_LOCAL2, 3, current_offset())) {
+        // The array is a local too and its get was fused with the index.
+        slot = chunk->code[last + 2];
+    } else {
+        return NULL;
+    }
+
+    for (Loop *loop = c->loop; loop != NULL; loop = loop->enclosing) {
+        if (loop->counter == slot) return loop->counter_indexes_count < COUNTER_INDEXES_MAX ? loop : NULL;
+    }
+    return NULL;
+}
+
+static void emit_array_access(OpCode opcode, Loop *counter_loop) {
+    if (counter_loop == NULL) {
+        emit_byte(opcode);
+        return;
+    }
+
+    counter_loop->counter_indexes[counter_loop->counter_indexes_count++] = current_offset();
+    emit_byte(opcode == OP_ARRAY_GET ? OP_ARRAY_GET_COUNTER : OP_ARRAY_SET_COUNTER);
+}
 
 static void index_op(bool can_assign) {
+    uint32_t index_start = current_offset();
     expression();
     expect(TOKEN_RIGHT_BRACKET, "Unclosed '[', expected ']' after index");
+    Loop *counter_loop = index_counter_loop(index_start);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_byte(OP_ARRAY_SET);
+        emit_array_access(OP_ARRAY_SET, counter_loop);
     } else if (match(TOKEN_PLUS_PLUS)) {
         // incr/decr cannot be efficiently implemented using other instructions
         // because array get/set consume array instance, which cannot be dupped
@@ -539,8 +774,22 @@ static void index_op(bool can_assign) {
     } else if (match(TOKEN_MINUS_MINUS)) {
         emit_byte(OP_ARRAY_DECR);
     } else {
-        emit_byte(OP_ARRAY_GET);
+        emit_array_access(OP_ARRAY_GET, counter_loop);
+    }
+}
+
+static void emit_field(OpCode opcode, uint8_t name) {
+    uint32_t last = c->fusable_instrs[1];
+    if (opcode == OP_GET_FIELD && is_fusable(last, OP_GET_LOCAL, 2, current_offset())) {
+        current_chunk()->code[last] = OP_GET_LOCAL_FIELD;
+        emit_byte(name);
+    } else {
+        emit_byte2(opcode, name);
     }
+#ifdef INLINE_CACHING
+    // Zero-initialize inline cache.
+    emit_byte_n(0, sizeof(PropertyCache));
+#endif
 }
 
 static void dot(bool can_assign) {
@@ -549,29 +798,29 @@ static void dot(bool can_assign) {
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_byte2(OP_SET_FIELD, name);
+        emit_field(OP_SET_FIELD, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_num = args();
         emit_byte3(OP_INVOKE, name, arg_num);
 #ifdef INLINE_CACHING
         // Zero-initialize inline cache.
-        emit_byte_n(0, sizeof(cache_id_t) + sizeof(void *));
+        emit_byte_n(0, sizeof(InvokeCache));
 #endif
     } else if (match(TOKEN_PLUS_PLUS)) {
         // Get/set field consumes an instance from the stack, so we have to duplicate it for the second call.
         emit_byte(OP_DUP);
-        emit_byte2(OP_GET_FIELD, name);
+        emit_field(OP_GET_FIELD, name);
         emit_byte(OP_INCR);
-        emit_byte2(OP_SET_FIELD, name);
+        emit_field(OP_SET_FIELD, name);
         emit_byte(OP_DECR);
     } else if (match(TOKEN_MINUS_MINUS)) {
         emit_byte(OP_DUP);
-        emit_byte2(OP_GET_FIELD, name);
+        emit_field(OP_GET_FIELD, name);
         emit_byte(OP_DECR);
-        emit_byte2(OP_SET_FIELD, name);
+        emit_field(OP_SET_FIELD, name);
         emit_byte(OP_INCR);
     } else {
-        emit_byte2(OP_GET_FIELD, name);
+        emit_field(OP_GET_FIELD, name);
     }
 }
 
@@ -656,8 +905,174 @@ static void init_compiler(Compiler *compiler, FunctionType function_type, ObjStr
     c = compiler;
 }
 
+// Returns the offset of the instruction after the one at `offset`, and stores by how much it changes the stack depth
+// in `effect` and the most it pushes on the way in `peak`.
+static uint32_t instr_stack_effect(const Chunk *chunk, uint32_t offset, int32_t *effect, int32_t *peak) {
+    const uint8_t *operands = chunk->code + offset + 1;
+    uint32_t length = 1;
+    *effect = 0;
+    *peak = 0;
+    switch ((OpCode) chunk->code[offset]) {
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_INCR:
+        case OP_DECR:
+        case OP_RETURN:
+        case OP_YIELD:
+        case OP_AWAIT: *effect = 0; break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUP: *effect = 1; break;
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_ARRAY_GET:
+        case OP_ARRAY_INCR:
+        case OP_ARRAY_DECR:
+        case OP_ARRAY_GET_COUNTER:
+        case OP_EQUAL_NUM:
+        case OP_ADD_NUM:
+        case OP_ADD_STRING: *effect = -1; break;
+        case OP_ARRAY_SET:
+        case OP_ARRAY_SET_COUNTER: *effect = -2; break;
+        case OP_CONSTANT:
+        case OP_CLASS:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE: *effect = 1, length = 2; break;
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE: *effect = 0, length = 2; break;
+        case OP_METHOD:
+        case OP_GET_SUPER: *effect = -1, length = 2; break;
+        case OP_POPN: *effect = -operands[0], length = 2; break;
+        case OP_CONCAT:
+        case OP_ARRAY: *effect = 1 - operands[0], length = 2; break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SPAWN: *effect = -operands[0], length = 2; break;
+        case OP_GET_GLOBAL: *effect = 1, length = 3; break;
+        case OP_SET_GLOBAL: *effect = 0, length = 3; break;
+        case OP_DEFINE_GLOBAL: *effect = -1, length = 3; break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP: *effect = 0, length = 3; break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_EQUAL: *effect = -2, length = 3; break;
+        case OP_GET_LOCAL2: *effect = 2, length = 3; break;
+        // Pushes both operands before adding them when they aren't numbers.
+        case OP_ADD_LOCAL_CONSTANT: *effect = 1, *peak = 2, length = 3; break;
+        case OP_FOR_LOOP: *effect = -1, length = 4; break;
+        case OP_CLOSURE: {
+            const ObjFunction *function = (const ObjFunction *) AS_OBJECT(chunk->constants.values[operands[0]]);
+            *effect = 1, length = 2 + 2 * function->upvalues_count;
+        } break;
+        case OP_GET_FIELD: *effect = 0, length = 2; break;
+        case OP_SET_FIELD: *effect = -1, length = 2; break;
+        case OP_GET_LOCAL_FIELD: *effect = 1, length = 3; break;
+        case OP_INVOKE: *effect = -operands[1], length = 3; break;
+        case OP_SUPER_INVOKE: *effect = -operands[1] - 1, length = 3; break;
+        case OP_COUNT: UNREACHABLE();
+    }
+
+#ifdef INLINE_CACHING
+    switch ((OpCode) chunk->code[offset]) {
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+        case OP_GET_LOCAL_FIELD: length += sizeof(PropertyCache); break;
+        case OP_INVOKE: length += sizeof(InvokeCache); break;
+        case OP_SUPER_INVOKE: length += sizeof(void *); break;
+        default: break;
+    }
+#endif
+
+    if (*effect > *peak) *peak = *effect;
+    return offset + length;
+}
+
+// Records the depth a path reaches the instruction at `target` with, and queues it when no path reached it before.
+static void reach_instr(int32_t *depths, uint32_t *pending, uint32_t *pending_count, uint32_t target, int32_t depth) {
+    assert((depths[target] == -1 || depths[target] == depth) && "Inconsistent stack depth");
+    if (depths[target] != -1) return;
+    depths[target] = depth;
+    pending[(*pending_count)++] = target;
+}
+
+// Returns the deepest the stack of a frame running the function gets, counting the callee slot, arguments, locals and
+// temporaries. Follows every path through the bytecode, which reaches each instruction with the same depth.
+static uint32_t max_stack_depth(const ObjFunction *function) {
+    const Chunk *chunk = &function->chunk;
+    // Depth before each instruction, -1 until a path reaches it, and the starts of paths left to follow.
+    int32_t *depths = malloc(sizeof(*depths) * chunk->length);
+    uint32_t *pending = malloc(sizeof(*pending) * chunk->length);
+    if (depths == NULL || pending == NULL) OUT_OF_MEMORY();
+    for (uint32_t i = 0; i < chunk->length; i++) depths[i] = -1;
+
+    uint32_t pending_count = 0;
+    int32_t max_depth = function->arity + 1;
+    depths[0] = max_depth;
+    pending[pending_count++] = 0;
+
+    while (pending_count > 0) {
+        uint32_t offset = pending[--pending_count];
+        int32_t depth = depths[offset];
+        int32_t effect, peak;
+        uint32_t next = instr_stack_effect(chunk, offset, &effect, &peak);
+        if (depth + peak > max_depth) max_depth = depth + peak;
+        depth += effect;
+
+        const uint8_t *code = chunk->code;
+        uint16_t jump;
+        switch ((OpCode) code[offset]) {
+            case OP_RETURN: break;
+            case OP_JUMP:
+                memcpy(&jump, code + offset + 1, sizeof(jump));
+                reach_instr(depths, pending, &pending_count, next + jump, depth);
+                break;
+            case OP_LOOP:
+                memcpy(&jump, code + offset + 1, sizeof(jump));
+                reach_instr(depths, pending, &pending_count, next - jump, depth);
+                break;
+            case OP_FOR_LOOP:
+                memcpy(&jump, code + offset + 2, sizeof(jump));
+                reach_instr(depths, pending, &pending_count, next - jump, depth);
+                reach_instr(depths, pending, &pending_count, next, depth);
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_EQUAL:
+                memcpy(&jump, code + offset + 1, sizeof(jump));
+                reach_instr(depths, pending, &pending_count, next + jump, depth);
+                reach_instr(depths, pending, &pending_count, next, depth);
+                break;
+            default: reach_instr(depths, pending, &pending_count, next, depth); break;
+        }
+    }
+    free(depths);
+    free(pending);
+    return (uint32_t) max_depth;
+}
+
 static ObjFunction *end_compiler(void) {
     emit_return();
+    if (!p.had_error) c->function->max_depth = max_stack_depth(c->function);
 
 #ifdef DEBUG_PRINT_BYTECODE
     if (!p.had_error) disassemble_chunk(current_chunk(), c->function->name->cstr);
@@ -670,12 +1085,13 @@ static ObjFunction *end_compiler(void) {
 
 static void begin_scope(void) { c->scope_depth++; }
 
-static void end_scope(void) {
+// Emits pops of locals deeper than `depth` without forgetting them, and returns their count.
+static uint32_t pop_locals(int depth) {
     uint8_t pop_count = 0;
 
-    c->scope_depth--;
-    for (; c->locals_count > 0 && c->locals[c->locals_count - 1].depth > c->scope_depth; c->locals_count--) {
-        if (!c->locals[c->locals_count - 1].is_captured) {
+    uint32_t count = c->locals_count;
+    for (; count > 0 && c->locals[count - 1].depth > depth; count--) {
+        if (!c->locals[count - 1].is_captured) {
             pop_count++;
             continue;
         }
@@ -688,6 +1104,13 @@ static void end_scope(void) {
         emit_byte(OP_CLOSE_UPVALUE);
     }
     if (pop_count > 0) emit_pop(pop_count);
+
+    return c->locals_count - count;
+}
+
+static void end_scope(void) {
+    c->scope_depth--;
+    c->locals_count -= pop_locals(c->scope_depth);
 }
 
 static void add_local(Token name) {
@@ -721,10 +1144,10 @@ static void mark_initialized(void) {
     c->locals[c->locals_count - 1].depth = c->scope_depth;
 }
 
-static uint8_t declare_var(void) {
+static uint16_t declare_var(void) {
     if (c->scope_depth == 0) {
-        // Global variables are looked up by name, so we save their name as a constant.
-        return identifier_constant(p.previous);
+        // Global variables live in slots shared by all chunks, resolve the name to one.
+        return resolve_global(p.previous);
     } else {
         // Local variables do not need that, return a dummy value.
         declare_local();
@@ -732,9 +1155,9 @@ static uint8_t declare_var(void) {
     }
 }
 
-static void define_var(uint8_t global) {
+static void define_var(uint16_t global) {
     if (c->scope_depth == 0) {
-        emit_byte2(OP_DEFINE_GLOBAL, global);
+        emit_var(OP_DEFINE_GLOBAL, global);
     } else {
         mark_initialized();
     }
@@ -773,6 +1196,10 @@ static void block(void) {
 static void expression_stmt(void) {
     expression();
     expect(TOKEN_SEMICOLON, "Expected ';' after expression");
+
+    // Nobody can await the result, so an async callee doesn't need a promise.
+    uint32_t last = c->fusable_instrs[1];
+    if (is_fusable(last, OP_CALL, 2, current_offset())) current_chunk()->code[last] = OP_SPAWN;
     emit_byte(OP_POP);
 }
 
@@ -789,44 +1216,129 @@ static void if_stmt(void) {
     expression();
     expect(TOKEN_RIGHT_PAREN, "Unclosed '(', expected ')' after condition");
 
-    uint32_t jump_over_then = emit_jump(OP_JUMP_IF_FALSE);
-
-    emit_byte(OP_POP);
+    ConditionJump jump_over_then = emit_condition_jump();
     statement();
+
+    // Without else and without a condition to pop there is nothing to jump over.
+    if (jump_over_then.fused && !is_next(TOKEN_ELSE)) {
+        patch_condition_jump(jump_over_then);
+        return;
+    }
     uint32_t jump_over_else = emit_jump(OP_JUMP);
 
-    patch_jump(jump_over_then);
-    emit_byte(OP_POP);
+    patch_condition_jump(jump_over_then);
     if (match(TOKEN_ELSE)) statement();
 
     patch_jump(jump_over_else);
 }
 
+static void begin_loop(Loop *loop, uint32_t continue_loop, int counter) {
+    *loop = (Loop) {
+        .enclosing = c->loop,
+        .continue_loop = continue_loop,
+        .scope_depth = c->scope_depth,
+        .breaks = NO_JUMPS,
+        .continues = NO_JUMPS,
+        .counter = counter,
+    };
+    c->loop = loop;
+}
+
+static void end_loop(void) {
+    Loop *loop = c->loop;
+    // Array accesses indexed by the counter have to check it after all if the body changed it.
+    if (loop->counter != NO_COUNTER && (loop->counter_written || c->locals[loop->counter].is_captured)) {
+        for (uint32_t i = 0; i < loop->counter_indexes_count; i++) {
+            uint8_t *opcode = &current_chunk()->code[loop->counter_indexes[i]];
+            *opcode = *opcode == OP_ARRAY_GET_COUNTER ? OP_ARRAY_GET : OP_ARRAY_SET;
+        }
+    }
+
+    patch_jumps(loop->breaks);
+    c->loop = loop->enclosing;
+}
+
+// Matches the condition between `start` and its fused jump at `end` against `counter < limit`.
+static bool counted_condition(uint32_t start, uint32_t end, CountedLoop *loop) {
+    Chunk *chunk = current_chunk();
+    uint8_t *code = chunk->code;
+    if (code[end] != OP_JUMP_IF_NOT_LESS) return false;
+
+    uint32_t length = end - start;
+    if (length == 3 && code[start] == OP_GET_LOCAL2 && code[start + 1] != code[start + 2]) {
+        loop->counter = code[start + 1];
+        loop->limit[0] = OP_GET_LOCAL;
+        loop->limit[1] = code[start + 2];
+        loop->limit_length = 2;
+    } else if (length >= 4 && code[start] == OP_GET_LOCAL) {
+        uint8_t limit_op = code[start + 2];
+        uint32_t limit_length = limit_op == OP_GET_GLOBAL ? 3 : 2;
+        bool is_limit = limit_op == OP_GET_GLOBAL || limit_op == OP_CONSTANT || limit_op == OP_GET_UPVALUE;
+        if (!is_limit || length != 2 + limit_length) return false;
+
+        loop->counter = code[start + 1];
+        loop->limit_length = length - 2;
+        memcpy(loop->limit, &code[start + 2], loop->limit_length);
+    } else {
+        return false;
+    }
+
+    loop->limit_loc = chunk->locs[end];
+    return true;
+}
+
+// Matches the update after `start` against `counter++` or `counter = counter + 1`.
+static bool counted_update(uint32_t start, uint8_t counter) {
+    Chunk *chunk = current_chunk();
+    uint8_t *code = &chunk->code[start];
+    uint32_t length = current_offset() - start;
+
+    const uint8_t incr[] = {OP_GET_LOCAL, counter, OP_INCR, OP_SET_LOCAL, counter, OP_DECR};
+    if (length == sizeof(incr)) return memcmp(code, incr, length) == 0;
+
+    const uint8_t add[] = {OP_ADD_LOCAL_CONSTANT, counter, code[2], OP_SET_LOCAL, counter};
+    if (length != sizeof(add) || memcmp(code, add, length) != 0) return false;
+    Value one = chunk->constants.values[code[2]];
+    return IS_NUMBER(one) && AS_NUMBER(one) == 1;
+}
+
+// Whether the initializer between `start` and `end` only declared the counter with a non-negative integer constant.
+static bool counter_starts_at_index(uint32_t start, uint32_t end, uint8_t counter) {
+    Chunk *chunk = current_chunk();
+    if (end - start != 2 || chunk->code[start] != OP_CONSTANT || counter != c->locals_count - 1) return false;
+    return check_int_arg(chunk->constants.values[chunk->code[start + 1]], 0, UINT32_MAX);
+}
+
+static void emit_counted_loop(const CountedLoop *loop, uint32_t body_start) {
+    Chunk *chunk = current_chunk();
+    for (uint32_t i = 0; i < loop->limit_length; i++) push_byte(chunk, loop->limit[i], loop->limit_loc);
+
+    push_byte(chunk, OP_FOR_LOOP, loop->update_loc);
+    push_byte(chunk, loop->counter, loop->update_loc);
+    // 2 adjusts for the offset operand.
+    uint32_t offset = current_offset() + 2 - body_start;
+    if (offset > UINT16_MAX) error_at(chunk->locs[body_start], "Loop body is too big");
+    push_byte(chunk, offset & 0xFF, loop->update_loc);
+    push_byte(chunk, (offset >> 8) & 0xFF, loop->update_loc);
+}
+
 static void while_stmt(void) {
-    uint32_t loop_start = current_offset();
+    uint32_t loop_start = jump_target();
 
     advance();
     expect(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
     expression();
     expect(TOKEN_RIGHT_PAREN, "Unclosed '(', expected ')' after condition");
 
-    uint32_t break_loop = current_offset();
-    uint32_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    ConditionJump exit_jump = emit_condition_jump();
 
-    Loop *prev_loop = c->loop;
-    Loop loop = {
-        .continue_loop = loop_start,
-        .break_loop = break_loop,
-    };
-    c->loop = &loop;
+    Loop loop;
+    begin_loop(&loop, loop_start, NO_COUNTER);
     statement();
-    c->loop = prev_loop;
-
     emit_loop(loop_start);
 
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    patch_condition_jump(exit_jump);
+    end_loop();
 }
 
 static void for_stmt(void) {
@@ -835,6 +1347,7 @@ static void for_stmt(void) {
     advance();
     expect(TOKEN_LEFT_PAREN, "Expected '(' after 'for'");
 
+    uint32_t init_start = current_offset();
     if (is_next(TOKEN_VAR)) {
         var_decl();
     } else if (!match(TOKEN_SEMICOLON)) {
@@ -843,7 +1356,7 @@ static void for_stmt(void) {
         expect(TOKEN_SEMICOLON, "Expected ';' after initializer clause of 'for'");
     }
 
-    uint32_t loop_start = current_offset();
+    uint32_t loop_start = jump_target();
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         expect(TOKEN_SEMICOLON, "Expected ';' after condition clause of 'for'");
@@ -851,39 +1364,56 @@ static void for_stmt(void) {
         emit_byte(OP_TRUE);
     }
 
-    uint32_t break_loop = current_offset();
-    uint32_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    ConditionJump exit_jump = emit_condition_jump();
+    CountedLoop counted_loop;
+    bool is_counted = exit_jump.fused && counted_condition(loop_start, exit_jump.offset - 1, &counted_loop);
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         // If the loop has update clause, then we skip it after condition clause
         // using body_jump and then return by changing loop_start to point here.
         uint32_t body_jump = emit_jump(OP_JUMP);
 
-        uint32_t update_start = current_offset();
+        uint32_t update_start = jump_target();
         expression();
-        emit_byte(OP_POP);
+        is_counted = is_counted && counted_update(update_start, counted_loop.counter);
+        if (is_counted) {
+            // The counted loop instruction after the body does the update, so it is dropped with the jump over it.
+            counted_loop.update_loc = p.previous.loc;
+            truncate_chunk(body_jump - 1);
+        } else {
+            emit_byte(OP_POP);
+        }
         expect(TOKEN_RIGHT_PAREN, "Unclosed '(', expected ')' after for loop's clauses");
 
-        emit_loop(loop_start);
-        loop_start = update_start;
+        if (!is_counted) {
+            emit_loop(loop_start);
+            loop_start = update_start;
 
-        patch_jump(body_jump);
+            patch_jump(body_jump);
+        }
+    } else {
+        is_counted = false;
     }
 
-    Loop *prev_loop = c->loop;
-    Loop loop = {
-        .continue_loop = loop_start,
-        .break_loop = break_loop,
-    };
-    c->loop = &loop;
+    Loop loop;
+    if (is_counted) {
+        bool is_index = counter_starts_at_index(init_start, loop_start, counted_loop.counter);
+        begin_loop(&loop, CONTINUE_FORWARD, is_index ? counted_loop.counter : NO_COUNTER);
+    } else {
+        begin_loop(&loop, loop_start, NO_COUNTER);
+    }
+    uint32_t body_start = jump_target();
     statement();
-    c->loop = prev_loop;
 
-    emit_loop(loop_start);
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    if (is_counted) {
+        patch_jumps(loop.continues);
+        emit_counted_loop(&counted_loop, body_start);
+    } else {
+        emit_loop(loop_start);
+    }
 
+    patch_condition_jump(exit_jump);
+    end_loop();
     end_scope();
 }
 
@@ -898,6 +1428,11 @@ static void return_stmt(void) {
 
         expression();
         expect(TOKEN_SEMICOLON, "Expected ';' after return");
+
+        // Async functions fulfill their promise on return, so only synchronous frames are reused by the callee.
+        uint32_t last = c->fusable_instrs[1];
+        bool is_sync = c->function_type == FUN_FUNCTION || c->function_type == FUN_METHOD;
+        if (is_sync && is_fusable(last, OP_CALL, 2, current_offset())) current_chunk()->code[last] = OP_TAIL_CALL;
         emit_byte(OP_RETURN);
     }
 }
@@ -912,9 +1447,8 @@ static void break_stmt(void) {
         return;
     }
 
-    // Break jumps to OP_JUMP_IF_FALSE which jumps to the end of the loop.
-    emit_byte(OP_FALSE);
-    emit_loop(c->loop->break_loop);
+    pop_locals(c->loop->scope_depth);
+    c->loop->breaks = emit_chained_jump(c->loop->breaks);
 }
 
 static void continue_stmt(void) {
@@ -927,7 +1461,14 @@ static void continue_stmt(void) {
         return;
     }
 
-    emit_loop(c->loop->continue_loop);
+    if (c->loop->continue_loop != CONTINUE_FORWARD) {
+        pop_locals(c->loop->scope_depth);
+        emit_loop(c->loop->continue_loop);
+        return;
+    }
+
+    pop_locals(c->loop->scope_depth);
+    c->loop->continues = emit_chained_jump(c->loop->continues);
 }
 
 static void switch_stmt(void) {
@@ -941,21 +1482,18 @@ static void switch_stmt(void) {
     uint32_t exit_jumps_idx = 0;
     uint32_t exit_jumps[max_cases];
     uint32_t default_offset = 0;
-    uint32_t case_jump = 0;
+    ConditionJump case_jump = {0};
     while (!is_next(TOKEN_EOF) && !is_next(TOKEN_RIGHT_BRACE)) {
         uint32_t jump_over_default = 0;
         if (match(TOKEN_DEFAULT)) {
             jump_over_default = emit_jump(OP_JUMP);
 
             if (default_offset != 0) error_current("Switch cannot have multiple default cases");
-            default_offset = current_offset();
+            default_offset = jump_target();
         } else {
             expect(TOKEN_CASE, "Expected case inside of switch");
 
-            if (case_jump != 0) {
-                patch_jump(case_jump);
-                emit_byte(OP_POP);
-            }
+            if (case_jump.offset != 0) patch_condition_jump(case_jump);
 
             // Duplicate switch value since equal consumes both operands.
             emit_byte(OP_DUP);
@@ -964,9 +1502,8 @@ static void switch_stmt(void) {
             // of case expressions that have side effects. In addition, this allows to
             // implement optimizations such as jump table.
             constant_expression();
-            emit_byte(OP_EQUAL);
-            case_jump = emit_jump(OP_JUMP_IF_FALSE);
-            emit_byte(OP_POP);
+            emit_compare(OP_EQUAL, false);
+            case_jump = emit_condition_jump();
         }
 
         expect(TOKEN_COLON, "Expected ':' after case");
@@ -984,10 +1521,7 @@ static void switch_stmt(void) {
     }
     expect(TOKEN_RIGHT_BRACE, "Unclosed '{', expected '}' at the end of switch body");
 
-    if (case_jump != 0) {
-        patch_jump(case_jump);
-        emit_byte(OP_POP);  // jump's operand
-    }
+    if (case_jump.offset != 0) patch_condition_jump(case_jump);
 
     if (default_offset != 0) emit_loop(default_offset);
 
@@ -1032,7 +1566,7 @@ static void var_decl(void) {
     advance();
     expect(TOKEN_IDENTIFIER, "Expected a variable name after 'var'");
 
-    uint8_t global = declare_var();
+    uint16_t global = declare_var();
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -1087,7 +1621,7 @@ static void fun_decl(void) {
     if (is_async) expect(TOKEN_FUN, "Expected 'fun' after 'async'");
     expect(TOKEN_IDENTIFIER, "Expected function name after 'fun'");
 
-    uint8_t global = declare_var();
+    uint16_t global = declare_var();
     mark_initialized();  // Define it right away to allow recursive functions.
 
     function(is_async ? FUN_ASYNC : FUN_FUNCTION);
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
 #define READ_U8() (chunk->code[offset++])
@@ -23,6 +24,17 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
         uint8_t constant = READ_U8();                                                                \
         printf(instr " %u '%s'\n", constant, value_to_temp_cstr(chunk->constants.values[constant])); \
     } while (0)
+#define LOCAL_CONST_INSTR(instr)                                                                              \
+    do {                                                                                                      \
+        uint8_t slot = READ_U8();                                                                             \
+        uint8_t constant = READ_U8();                                                                         \
+        printf(instr " %u %u '%s'\n", slot, constant, value_to_temp_cstr(chunk->constants.values[constant])); \
+    } while (0)
+#define GLOBAL_INSTR(instr)                                        \
+    do {                                                           \
+        uint16_t slot = READ_U16();                                \
+        printf(instr " %u '%s'\n", slot, global_name(slot)->cstr); \
+    } while (0)
 #define INVOKE_INSTR(instr)                                                                                      \
     do {                                                                                                         \
         uint8_t constant = READ_U8();                                                                            \
@@ -59,9 +71,9 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
         case OP_NEGATE:        INSTR("negate"); break;
         case OP_INCR:          INSTR("incr"); break;
         case OP_DECR:          INSTR("decr"); break;
-        case OP_DEFINE_GLOBAL: CONST_INSTR("define global"); break;
-        case OP_GET_GLOBAL:    CONST_INSTR("get global"); break;
-        case OP_SET_GLOBAL:    CONST_INSTR("set global"); break;
+        case OP_DEFINE_GLOBAL: GLOBAL_INSTR("define global"); break;
+        case OP_GET_GLOBAL:    GLOBAL_INSTR("get global"); break;
+        case OP_SET_GLOBAL:    GLOBAL_INSTR("set global"); break;
         case OP_GET_LOCAL:     U8_INSTR("get local"); break;
         case OP_SET_LOCAL:     U8_INSTR("set local"); break;
         case OP_GET_UPVALUE:   U8_INSTR("get upvalue"); break;
@@ -76,10 +88,12 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
             printf("loop %u -> %04u\n", loop_offset, offset - loop_offset);
         } break;
         case OP_CALL:    U8_INSTR("call"); break;
+        case OP_TAIL_CALL: U8_INSTR("tail call"); break;
+        case OP_SPAWN:     U8_INSTR("spawn"); break;
         case OP_CLOSURE: {
             uint8_t constant = chunk->code[offset];
             CONST_INSTR("closure");
-            ObjFunction *function = (ObjFunction *) chunk->constants.values[constant].as.object;
+            ObjFunction *function = (ObjFunction *) AS_OBJECT(chunk->constants.values[constant]);
             for (uint32_t i = 0; i < function->upvalues_count; i++) {
                 uint8_t is_local = READ_U8();
                 uint8_t index = READ_U8();
@@ -91,12 +105,22 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
         case OP_CLASS:         CONST_INSTR("class"); break;
         case OP_METHOD:        CONST_INSTR("method"); break;
         case OP_INHERIT:       INSTR("inherit"); break;
-        case OP_GET_FIELD:     CONST_INSTR("get field"); break;
-        case OP_SET_FIELD:     CONST_INSTR("set field"); break;
-        case OP_INVOKE:        {
+        case OP_GET_FIELD:     {
+            CONST_INSTR("get field");
+#ifdef INLINE_CACHING
+            offset += sizeof(PropertyCache);
+#endif
+        } break;
+        case OP_SET_FIELD: {
+            CONST_INSTR("set field");
+#ifdef INLINE_CACHING
+            offset += sizeof(PropertyCache);
+#endif
+        } break;
+        case OP_INVOKE: {
             INVOKE_INSTR("invoke");
 #ifdef INLINE_CACHING
-            offset += sizeof(cache_id_t) + sizeof(void *);
+            offset += sizeof(InvokeCache);
 #endif
         } break;
         case OP_GET_SUPER:    CONST_INSTR("get super"); break;
@@ -113,6 +137,33 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
         case OP_ARRAY_SET:  INSTR("array set"); break;
         case OP_ARRAY_INCR: INSTR("array incr"); break;
         case OP_ARRAY_DECR: INSTR("array decr"); break;
+        case OP_GET_LOCAL2: {
+            uint8_t first = READ_U8();
+            printf("get local2 %u %u\n", first, READ_U8());
+        } break;
+        case OP_ADD_LOCAL_CONSTANT: LOCAL_CONST_INSTR("add local const"); break;
+        case OP_GET_LOCAL_FIELD:    {
+            LOCAL_CONST_INSTR("get local field");
+#ifdef INLINE_CACHING
+            offset += sizeof(PropertyCache);
+#endif
+        } break;
+        case OP_JUMP_IF_NOT_LESS:    JUMP_INSTR("jump if not less"); break;
+        case OP_JUMP_IF_NOT_GREATER: JUMP_INSTR("jump if not greater"); break;
+        case OP_JUMP_IF_NOT_EQUAL:   JUMP_INSTR("jump if not equal"); break;
+        case OP_JUMP_IF_LESS:        JUMP_INSTR("jump if less"); break;
+        case OP_JUMP_IF_GREATER:     JUMP_INSTR("jump if greater"); break;
+        case OP_JUMP_IF_EQUAL:       JUMP_INSTR("jump if equal"); break;
+        case OP_FOR_LOOP:            {
+            uint8_t slot = READ_U8();
+            uint16_t loop_offset = READ_U16();
+            printf("for loop %u %u -> %04u\n", slot, loop_offset, offset - loop_offset);
+        } break;
+        case OP_ARRAY_GET_COUNTER:   INSTR("array get counter"); break;
+        case OP_ARRAY_SET_COUNTER:   INSTR("array set counter"); break;
+        case OP_EQUAL_NUM:  INSTR("equal num"); break;
+        case OP_ADD_NUM:    INSTR("add num"); break;
+        case OP_ADD_STRING: INSTR("add string"); break;
         default:            printf("unknown opcode %d\n", opcode); break;
     }
     return offset;
@@ -123,6 +174,8 @@ uint32_t disassemble_instr(const Chunk *chunk, uint32_t offset) {
 #undef U8_INSTR
 #undef JUMP_INSTR
 #undef CONST_INSTR
+#undef LOCAL_CONST_INSTR
+#undef GLOBAL_INSTR
 #undef INVOKE_INSTR
 }
 
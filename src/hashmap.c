@@ -1,12 +1,13 @@
 #include "hashmap.h"
-#include <assert.h>
 #include <string.h>
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 
 #define MAX_LOAD 0.75
-#define TOMBSTONE_VALUE_TYPE VAL_BOOL  // Any non-null value
+// Empty entries are zeroed, which is never a boolean.
+#define TOMBSTONE_VALUE VALUE_BOOL(true)
+#define IS_TOMBSTONE(entry) ((entry)->key == NULL && IS_BOOL((entry)->value))
 
 static Entry *find_entry(Entry *entries, uint32_t capacity, const ObjString *key) {
     Entry *tombstone = NULL;
@@ -16,7 +17,7 @@ static Entry *find_entry(Entry *entries, uint32_t capacity, const ObjString *key
         if (entry->key == key) {
             return entry;
         } else if (entry->key == NULL) {
-            if (entry->value.type == TOMBSTONE_VALUE_TYPE) {
+            if (IS_TOMBSTONE(entry)) {
                 if (tombstone == NULL) tombstone = entry;
             } else {
                 return tombstone == NULL ? entry : tombstone;
@@ -25,11 +26,16 @@ static Entry *find_entry(Entry *entries, uint32_t capacity, const ObjString *key
     }
 }
 
+// Rehashes the entries without tombstones, into a bigger array unless most of the count were tombstones.
 static void grow_map(HashMap *map) {
-    uint32_t new_capacity = MAP_GROW_CAPACITY(map->capacity);
+    uint32_t live_count = 0;
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key != NULL) live_count++;
+    }
+    bool is_sparse = live_count < map->capacity * MAX_LOAD / 2;
+    uint32_t new_capacity = is_sparse ? map->capacity : MAP_GROW_CAPACITY(map->capacity);
     Entry *new_entries = ARRAY_ALLOC(new_entries, new_capacity);
 
-    static_assert(VAL_NIL == 0, "Nil type must be 0");
     memset(new_entries, 0, sizeof(*map->entries) * new_capacity);
 
     // Recount to exclude tombstones.
@@ -73,15 +79,17 @@ bool hashmap_get(HashMap *map, const ObjString *key, Value *value) {
     return true;
 }
 
+bool hashmap_is_full(const HashMap *map) { return map->count >= map->capacity * MAX_LOAD; }
+
 bool hashmap_set(HashMap *map, ObjString *key, Value value) {
 #ifdef DEBUG_STRESS_GC
     collect_garbage();
 #endif
-    if (map->count >= map->capacity * MAX_LOAD) grow_map(map);
+    if (hashmap_is_full(map)) grow_map(map);
 
     Entry *entry = find_entry(map->entries, map->capacity, key);
     bool is_new = entry->key == NULL;
-    if (is_new && entry->value.type != TOMBSTONE_VALUE_TYPE) map->count++;
+    if (is_new && !IS_TOMBSTONE(entry)) map->count++;
 
     entry->key = key;
     entry->value = value;
@@ -103,7 +111,7 @@ bool hashmap_delete(HashMap *map, const ObjString *key) {
     if (entry->key == NULL) return false;
 
     entry->key = NULL;
-    entry->value.type = TOMBSTONE_VALUE_TYPE;
+    entry->value = TOMBSTONE_VALUE;
     return true;
 }
 
@@ -114,7 +122,7 @@ ObjString *hashmap_find_key(HashMap *map, const char *cstr, uint32_t length, uin
         ObjString *key = map->entries[index].key;
 
         if (key == NULL) {
-            if (map->entries[index].value.type != TOMBSTONE_VALUE_TYPE) return NULL;
+            if (!IS_TOMBSTONE(&map->entries[index])) return NULL;
         } else if (key->hash == hash && key->length == length && memcmp(key->cstr, cstr, length) == 0) {
             return key;
         }
@@ -21,6 +21,8 @@ typedef struct {
 uint32_t hash_string(const char *cstr, uint32_t length);
 void free_hashmap(HashMap *map);
 bool hashmap_get(HashMap *map, const ObjString *key, Value *value);
+// Whether setting a new key grows the map or rehashes it to drop tombstones.
+bool hashmap_is_full(const HashMap *map);
 bool hashmap_set(HashMap *map, ObjString *key, Value value);
 void hashmap_set_all(const HashMap *src, HashMap *dst);
 bool hashmap_delete(HashMap *map, const ObjString *key);
@@ -0,0 +1,179 @@
+#include "http.h"
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bitmap of the characters allowed in tokens (methods and header names), split into characters below and above 64.
+static const uint64_t TOKEN_CHARS[2] = {0x03ff6cfa00000000, 0x57ffffffc7fffffe};
+
+static bool is_token_char(char c) {
+    unsigned char u = (unsigned char) c;
+    return u < 128 && (TOKEN_CHARS[u >> 6] >> (u & 63)) & 1;
+}
+
+// Header values may have any character except control characters, tab is allowed.
+static bool is_value_char(char c) {
+    unsigned char u = (unsigned char) c;
+    return (u >= ' ' && u != 0x7f) || u == '\t';
+}
+
+static char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static bool span_equals(const char *data, HttpSpan span, const char *lowercase) {
+    if (span.length != strlen(lowercase)) return false;
+    for (uint32_t i = 0; i < span.length; i++) {
+        if (to_lower(data[span.start + i]) != lowercase[i]) return false;
+    }
+    return true;
+}
+
+// Returns the length of the head, or 0 when the empty line that ends it hasn't arrived yet.
+static uint32_t find_head_end(const char *data, uint32_t length, uint32_t *scanned) {
+    const char *end = data + length;
+    for (const char *c = data + *scanned; c < end && (c = memchr(c, '\n', end - c)) != NULL; c++) {
+        // The next search starts at this line end, in case the rest of the empty line hasn't arrived yet.
+        *scanned = (uint32_t) (c - data);
+        const char *next = c + 1;
+        if (next == end || (next[0] == '\r' && next + 1 == end)) return 0;
+        if (next[0] == '\n') return (uint32_t) (next + 1 - data);
+        if (next[0] == '\r' && next[1] == '\n') return (uint32_t) (next + 2 - data);
+    }
+    *scanned = length;
+    return 0;
+}
+
+// Returns the position of the first character from `position` that can't be in a header value, which is at the latest
+// the line end. Looks at 16 bytes at a time with SSE2.
+static uint32_t find_value_end(const char *data, uint32_t position, uint32_t end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i zero = _mm_setzero_si128();
+    for (; position + 16 <= end; position += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *) (data + position));
+        // Comparisons are signed, so characters from 128 up are below space too and are taken out again.
+        __m128i control = _mm_andnot_si128(_mm_cmplt_epi8(chars, zero), _mm_cmplt_epi8(chars, space));
+        control = _mm_andnot_si128(_mm_cmpeq_epi8(chars, tab), control);
+        control = _mm_or_si128(control, _mm_cmpeq_epi8(chars, del));
+        int mask = _mm_movemask_epi8(control);
+        if (mask != 0) return position + (uint32_t) __builtin_ctz((unsigned int) mask);
+    }
+#endif
+    while (position < end && is_value_char(data[position])) position++;
+    return position;
+}
+
+static bool parse_token(const char *data, uint32_t *position, HttpSpan *span) {
+    span->start = *position;
+    while (is_token_char(data[*position])) (*position)++;
+    span->length = *position - span->start;
+    return span->length > 0;
+}
+
+static bool skip_line_end(const char *data, uint32_t *position) {
+    if (data[*position] == '\r' && data[*position + 1] == '\n') {
+        *position += 2;
+        return true;
+    }
+    if (data[*position] == '\n') {
+        *position += 1;
+        return true;
+    }
+    return false;
+}
+
+static bool parse_content_length(const char *data, HttpSpan value, uint32_t *content_length) {
+    if (value.length == 0) return false;
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < value.length; i++) {
+        char c = data[value.start + i];
+        if (c < '0' || c > '9') return false;
+        result = result * 10 + (uint32_t) (c - '0');
+        if (result > HTTP_MAX_BODY_LENGTH) return false;
+    }
+    *content_length = result;
+    return true;
+}
+
+// Looks for "close" and "keep-alive" in the comma-separated options of the Connection header.
+static void parse_connection(const char *data, HttpSpan value, bool *keep_alive) {
+    uint32_t end = value.start + value.length;
+    for (uint32_t position = value.start; position < end; position++) {
+        while (position < end && (data[position] == ' ' || data[position] == '\t')) position++;
+        HttpSpan option = {.start = position};
+        while (position < end && data[position] != ',') position++;
+        option.length = position - option.start;
+        while (option.length > 0 && (data[option.start + option.length - 1] == ' '
+                                     || data[option.start + option.length - 1] == '\t')) {
+            option.length--;
+        }
+
+        if (span_equals(data, option, "close")) *keep_alive = false;
+        if (span_equals(data, option, "keep-alive")) *keep_alive = true;
+    }
+}
+
+HttpStatus http_parse_head(const char *data, uint32_t length, uint32_t *scanned, HttpRequest *request) {
+    uint32_t head_length = find_head_end(data, length, scanned);
+    if (head_length == 0) return length > HTTP_MAX_HEAD_LENGTH ? HTTP_INVALID : HTTP_INCOMPLETE;
+    if (head_length > HTTP_MAX_HEAD_LENGTH) return HTTP_INVALID;
+    request->head_length = head_length;
+
+    // The head ends with a line end, which stops every scan below before they get past it.
+    uint32_t position = 0;
+    if (!parse_token(data, &position, &request->method) || data[position++] != ' ') return HTTP_INVALID;
+
+    request->path.start = position;
+    while ((unsigned char) data[position] > ' ' && data[position] != 0x7f) position++;
+    request->path.length = position - request->path.start;
+    if (request->path.length == 0 || data[position++] != ' ') return HTTP_INVALID;
+
+    request->version = (HttpSpan) {.start = position, .length = 8};
+    if (position + 8 > head_length || memcmp(data + position, "HTTP/1.", 7) != 0) return HTTP_INVALID;
+    char minor_version = data[position + 7];
+    if (minor_version != '0' && minor_version != '1') return HTTP_INVALID;
+    // Connections stay open after HTTP/1.1 requests unless the client asks otherwise.
+    request->keep_alive = minor_version == '1';
+    position += 8;
+    if (!skip_line_end(data, &position)) return HTTP_INVALID;
+
+    bool has_content_length = false;
+    request->content_length = 0;
+    request->headers_length = 0;
+    while (data[position] != '\r' && data[position] != '\n') {
+        if (request->headers_length == HTTP_MAX_HEADERS) return HTTP_INVALID;
+        HttpHeader *header = &request->headers[request->headers_length++];
+
+        // Lines starting with whitespace continue the previous header in the obsolete line folding, which isn't
+        // supported, so they aren't tokens either.
+        if (!parse_token(data, &position, &header->name) || data[position++] != ':') return HTTP_INVALID;
+        while (data[position] == ' ' || data[position] == '\t') position++;
+        header->value.start = position;
+        position = find_value_end(data, position, head_length);
+        header->value.length = position - header->value.start;
+        if (!skip_line_end(data, &position)) return HTTP_INVALID;
+        while (header->value.length > 0 && (data[header->value.start + header->value.length - 1] == ' '
+                                            || data[header->value.start + header->value.length - 1] == '\t')) {
+            header->value.length--;
+        }
+
+        if (span_equals(data, header->name, "content-length")) {
+            uint32_t content_length;
+            if (!parse_content_length(data, header->value, &content_length)) return HTTP_INVALID;
+            if (has_content_length && content_length != request->content_length) return HTTP_INVALID;
+            has_content_length = true;
+            request->content_length = content_length;
+        } else if (span_equals(data, header->name, "transfer-encoding")) {
+            return HTTP_INVALID;
+        } else if (span_equals(data, header->name, "connection")) {
+            parse_connection(data, header->value, &request->keep_alive);
+        }
+    }
+
+    return HTTP_COMPLETE;
+}
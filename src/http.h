@@ -0,0 +1,46 @@
+#ifndef CLOX_HTTP_H_
+#define CLOX_HTTP_H_
+
+#include "common.h"
+
+// Requests with more headers, a longer head or a longer body are rejected.
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEAD_LENGTH (64 * 1024)
+#define HTTP_MAX_BODY_LENGTH (16 * 1024 * 1024)
+
+typedef enum {
+    HTTP_COMPLETE,
+    HTTP_INCOMPLETE,
+    HTTP_INVALID,
+} HttpStatus;
+
+// Part of the parsed data, the parser doesn't copy anything.
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} HttpSpan;
+
+typedef struct {
+    HttpSpan name;
+    HttpSpan value;
+} HttpHeader;
+
+// Request line and headers of an HTTP/1.x request.
+typedef struct {
+    HttpSpan method;
+    HttpSpan path;
+    HttpSpan version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    uint32_t headers_length;
+    // Length of the request line and headers with the empty line after them, the body starts there.
+    uint32_t head_length;
+    uint32_t content_length;
+    bool keep_alive;
+} HttpRequest;
+
+// Parses the head of the request at the start of `data`. Returns HTTP_INCOMPLETE until the empty line after the
+// headers arrives, `scanned` keeps how far the data was searched for it between calls, starting at 0. Requests with a
+// body in chunked transfer encoding are invalid.
+HttpStatus http_parse_head(const char *data, uint32_t length, uint32_t *scanned, HttpRequest *request);
+
+#endif  // CLOX_HTTP_H_
@@ -1,11 +1,20 @@
 #define _GNU_SOURCE
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
 #include "error.h"
 #include "vm.h"
 
+#define MAX_WORKERS 1024
+// Workers that crash sooner than this after starting are restarted with a delay, so a script that always fails
+// doesn't keep the supervisor busy.
+#define WORKER_RESTART_DELAY_S 1
+
 static char *read_entire_file(const char *path) {
     FILE *file = fopen(path, "rb");
     if (file == NULL) PANIC("Unable to open file \"%s\": %s", path, strerror(errno));
@@ -30,8 +39,9 @@ static char *read_entire_file(const char *path) {
 
 static void usage(const char *program) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  %s        - REPL\n", program);
-    fprintf(stderr, "  %s <path> - run file\n", program);
+    fprintf(stderr, "  %s                      - REPL\n", program);
+    fprintf(stderr, "  %s <path>               - run file\n", program);
+    fprintf(stderr, "  %s --workers <n> <path> - run file in n worker processes sharing server ports\n", program);
 }
 
 static void run_repl(void) {
@@ -55,15 +65,11 @@ static void run_repl(void) {
     free(line);
 }
 
-static int run_file(const char *path) {
-    char *source = read_entire_file(path);
-
+static int run_source(const char *source) {
     init_vm();
     InterpretResult result = interpret(source);
     free_vm();
 
-    free(source);
-
     switch (result) {
         case RESULT_OK:            return EXIT_SUCCESS;
         case RESULT_COMPILE_ERROR: return EX_DATAERR;
@@ -72,12 +78,135 @@ static int run_file(const char *path) {
     }
 }
 
+static int run_file(const char *path) {
+    char *source = read_entire_file(path);
+    int status = run_source(source);
+    free(source);
+    return status;
+}
+
+typedef struct {
+    pid_t pid;
+    time_t started_at;
+} Worker;
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void handle_stop_signal(int signal) {
+    stop_signal = signal;
+}
+
+static time_t monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void start_worker(Worker *worker, const char *source) {
+    // Output buffered in the supervisor would otherwise be written again by the worker.
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) PANIC("Error in fork: %s", strerror(errno));
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        vm.is_worker = true;
+        exit(run_source(source));
+    }
+    worker->pid = pid;
+    worker->started_at = monotonic_seconds();
+}
+
+static void stop_workers(const Worker *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i].pid != 0) kill(workers[i].pid, SIGTERM);
+    }
+}
+
+// Runs the file in separate processes, each with its own VM, and restarts the ones that crash or fail with a runtime
+// error. Returns once all workers have finished successfully, or after a compile error or a stop signal.
+static int run_workers(const char *path, int count) {
+    char *source = read_entire_file(path);
+    Worker workers[MAX_WORKERS];
+
+    struct sigaction action = {.sa_handler = &handle_stop_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (int i = 0; i < count; i++) start_worker(&workers[i], source);
+
+    int status = EXIT_SUCCESS;
+    bool is_stopping = false;
+    int running = count;
+    while (running > 0) {
+        if (stop_signal != 0 && !is_stopping) {
+            is_stopping = true;
+            status = 128 + stop_signal;
+            stop_workers(workers, count);
+        }
+
+        int wait_status;
+        pid_t pid = waitpid(-1, &wait_status, 0);
+        if (pid == -1) {
+            if (errno != EINTR) PANIC("Error in waitpid: %s", strerror(errno));
+            continue;
+        }
+
+        Worker *worker = NULL;
+        for (int i = 0; i < count; i++) {
+            if (workers[i].pid == pid) worker = &workers[i];
+        }
+        if (worker == NULL) continue;
+        worker->pid = 0;
+
+        bool has_finished = WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == EXIT_SUCCESS;
+        if (is_stopping || has_finished) {
+            running--;
+            continue;
+        }
+        if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == EX_DATAERR) {
+            // Every worker would fail the same way.
+            status = EX_DATAERR;
+            is_stopping = true;
+            running--;
+            stop_workers(workers, count);
+            continue;
+        }
+
+        if (WIFSIGNALED(wait_status)) {
+            fprintf(stderr, "Worker %d was killed by signal %d, restarting.\n", (int) pid, WTERMSIG(wait_status));
+        } else {
+            fprintf(stderr, "Worker %d exited with status %d, restarting.\n", (int) pid, WEXITSTATUS(wait_status));
+        }
+        if (monotonic_seconds() - worker->started_at < WORKER_RESTART_DELAY_S) sleep(WORKER_RESTART_DELAY_S);
+        if (stop_signal == 0) {
+            start_worker(worker, source);
+        } else {
+            // Stopped during the delay, the other workers are stopped at the start of the next iteration.
+            running--;
+        }
+    }
+
+    free(source);
+    return status;
+}
+
 int main(int argc, char **argv) {
     if (argc == 1) {
         run_repl();
         return EXIT_SUCCESS;
     } else if (argc == 2) {
         return run_file(argv[1]);
+    } else if (argc == 4 && strcmp(argv[1], "--workers") == 0) {
+        char *end;
+        long count = strtol(argv[2], &end, 10);
+        if (*end != '\0' || count < 1 || count > MAX_WORKERS) {
+            fprintf(stderr, "The number of workers must be an integer between 1 and %d.\n", MAX_WORKERS);
+            return EX_USAGE;
+        }
+        return run_workers(argv[3], (int) count);
     } else {
         usage(argv[0]);
         return EX_USAGE;
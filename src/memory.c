@@ -5,10 +5,11 @@
 void *reallocate(void *old_ptr, size_t old_size, size_t new_size) {
     vm.allocated += new_size - old_size;
 
+    // Only collect when growing, since objects are also freed during the sweep.
 #ifdef DEBUG_STRESS_GC
     if (new_size > old_size) collect_garbage();
 #else
-    if (vm.allocated >= vm.next_gc) collect_garbage();
+    if (new_size > old_size && vm.allocated >= vm.next_gc) collect_garbage();
 #endif
 
     if (new_size == 0) {
@@ -45,32 +46,39 @@ void mark_object(Object *object) {
 }
 
 void mark_value(Value *value) {
-    if (value->type == VAL_OBJECT) mark_object(value->as.object);
+    if (IS_OBJECT(*value)) mark_object(AS_OBJECT(*value));
 }
 
-static void mark_coroutines(Coroutine *head) {
-    for (Coroutine *current = head; current != NULL; current = current->next) {
-        mark_object((Object *) current->promise);
+static void mark_coroutine(Coroutine *coroutine) {
+    mark_object((Object *) coroutine->promise);
 
-        for (Value *value = current->stack; value < current->stack_top; value++) {
-            mark_value(value);
-        }
+    for (Value *value = coroutine->stack; value < coroutine->stack_top; value++) {
+        mark_value(value);
+    }
 
-        for (CallFrame *frame = current->frames; frame <= current->frame; frame++) {
-            mark_object((Object *) frame->closure);
-        }
+    for (CallFrame *frame = coroutine->frames; frame <= coroutine->frame; frame++) {
+        mark_object((Object *) frame->closure);
+    }
+
+    for (ObjUpvalue *upvalue = coroutine->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        mark_object((Object *) upvalue);
     }
 }
 
+static void mark_coroutines(Coroutine *head) {
+    for (Coroutine *current = head; current != NULL; current = current->next) mark_coroutine(current);
+}
+
 static void mark_vm_roots(void) {
     mark_coroutines(vm.active_head);
-    mark_coroutines(vm.sleeping_head);
+    for (uint32_t i = 0; i < vm.timers_length; i++) mark_coroutine(vm.timers[i].coroutine);
     mark_object((Object *) vm.init_string);
     mark_object((Object *) vm.length_string);
-    hashmap_mark_entries(&vm.globals);
-
-    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
-        mark_object((Object *) upvalue);
+    mark_object((Object *) vm.request_class);
+    mark_object((Object *) vm.headers_class);
+    hashmap_mark_entries(&vm.global_slots);
+    for (uint32_t i = 0; i < vm.globals.length; i++) {
+        mark_value(&vm.globals.values[i]);
     }
 
     uint32_t i = 0;
@@ -111,12 +119,18 @@ static void trace_object(Object *object) {
         case OBJ_CLASS: {
             ObjClass *class = (ObjClass *) object;
             mark_object((Object *) class->name);
+            mark_object((Object *) class->root_shape);
             hashmap_mark_entries(&class->methods);
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             mark_object((Object *) instance->class);
-            hashmap_mark_entries(&instance->fields);
+            if (instance->shape == NULL) {
+                hashmap_mark_entries(&instance->fields.dictionary);
+            } else {
+                mark_object((Object *) instance->shape);
+                for (uint32_t i = 0; i < instance->shape->length; i++) mark_value(instance_slot(instance, i));
+            }
         } break;
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound_method = (ObjBoundMethod *) object;
@@ -140,6 +154,14 @@ static void trace_object(Object *object) {
             ObjArray *array = (ObjArray *) object;
             for (uint32_t i = 0; i < array->length; i++) mark_value(&array->elements[i]);
         } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            mark_object((Object *) shape->parent);
+            mark_object((Object *) shape->name);
+            hashmap_mark_entries(&shape->transitions);
+            hashmap_mark_entries(&shape->slots);
+        } break;
+        case OBJ_READER: mark_object((Object *) ((ObjReader *) object)->delimiter); break;
         default: UNREACHABLE();
     }
 }
@@ -1,15 +1,20 @@
+#define _GNU_SOURCE
 #include "native.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "common.h"
+#include "error.h"
+#include "http.h"
+#include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
@@ -20,15 +25,16 @@ static bool clock_(Value *result, UNUSED(Value *args)) {
 }
 
 static bool sleep_(Value *result, Value *args) {
-    if (args[0].type != VAL_NUMBER || args[0].as.number < 0) {
+    if (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0)) {
         runtime_error("The first argument is number of milliseconds, it must be a positive number");
         return false;
     }
-    double duration_ms = args[0].as.number;
+    // Fractions of a millisecond count, durations of centuries are as good as forever.
+    double duration_ns = AS_NUMBER(args[0]) * 1e6;
+    if (duration_ns > 1e19) duration_ns = 1e19;
 
     Coroutine *sleeping = ll_remove(&vm.active_head, &vm.coroutine);
-    sleeping->sleep_time_ms = get_time_ms() + duration_ms;
-    ll_add_head(&vm.sleeping_head, sleeping);
+    vm_add_timer(sleeping, get_time_ns() + (uint64_t) duration_ns);
 
     if (vm.coroutine == NULL && schedule_coroutine() == RESULT_RUNTIME_ERROR) return false;
 
@@ -45,11 +51,11 @@ static bool has_field(Value *result, Value *args) {
         runtime_error("The second argument must be a string");
         return false;
     }
-    ObjInstance *instance = (ObjInstance *) args[0].as.object;
-    ObjString *field = (ObjString *) args[1].as.object;
+    ObjInstance *instance = (ObjInstance *) AS_OBJECT(args[0]);
+    ObjString *field = (ObjString *) AS_OBJECT(args[1]);
 
     Value unused;
-    bool has_field = hashmap_get(&instance->fields, field, &unused);
+    bool has_field = instance_get_field(instance, field, &unused);
     *result = VALUE_BOOL(has_field);
     return true;
 }
@@ -63,10 +69,10 @@ static bool get_field(Value *result, Value *args) {
         runtime_error("The second argument must be a string");
         return false;
     }
-    ObjInstance *instance = (ObjInstance *) args[0].as.object;
-    ObjString *field = (ObjString *) args[1].as.object;
+    ObjInstance *instance = (ObjInstance *) AS_OBJECT(args[0]);
+    ObjString *field = (ObjString *) AS_OBJECT(args[1]);
 
-    if (!hashmap_get(&instance->fields, field, result)) {
+    if (!instance_get_field(instance, field, result)) {
         runtime_error("Undefined field '%s'", field->cstr);
         return false;
     }
@@ -82,10 +88,10 @@ static bool set_field(Value *result, Value *args) {
         runtime_error("The second argument must be a string");
         return false;
     }
-    ObjInstance *instance = (ObjInstance *) args[0].as.object;
-    ObjString *field = (ObjString *) args[1].as.object;
+    ObjInstance *instance = (ObjInstance *) AS_OBJECT(args[0]);
+    ObjString *field = (ObjString *) AS_OBJECT(args[1]);
 
-    hashmap_set(&instance->fields, field, args[2]);
+    instance_set_field(instance, field, args[2]);
     *result = args[2];
     return true;
 }
@@ -99,10 +105,10 @@ static bool delete_field(Value *result, Value *args) {
         runtime_error("The second argument must be a string");
         return false;
     }
-    ObjInstance *instance = (ObjInstance *) args[0].as.object;
-    ObjString *field = (ObjString *) args[1].as.object;
+    ObjInstance *instance = (ObjInstance *) AS_OBJECT(args[0]);
+    ObjString *field = (ObjString *) AS_OBJECT(args[1]);
 
-    hashmap_delete(&instance->fields, field);
+    instance_delete_field(instance, field);
     *result = VALUE_NIL();
     return true;
 }
@@ -116,6 +122,11 @@ static bool create_server(Value *result, UNUSED(Value *args)) {
 
     int optval = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    // The kernel spreads incoming connections between the workers listening on the same port.
+    if (vm.is_worker && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        runtime_error("Error in setsockopt (%s)", strerror(errno));
+        return false;
+    }
 
     if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
         runtime_error("Error in fcntl (%s)", strerror(errno));
@@ -135,8 +146,8 @@ static bool server_listen(Value *result, Value *args) {
         runtime_error("The second argument is a port number, it must be an integer between 1 and 65535");
         return false;
     }
-    int fd = (int) args[0].as.number;
-    uint16_t port = (uint16_t) args[1].as.number;
+    int fd = (int) AS_NUMBER(args[0]);
+    uint16_t port = (uint16_t) AS_NUMBER(args[1]);
 
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
@@ -160,28 +171,19 @@ static bool server_listen(Value *result, Value *args) {
     return true;
 }
 
-typedef struct {
-    ObjPromise *promise;
-} ServerAcceptData;
-
-static bool server_accept_callback(EpollData *epoll_data) {
-    ServerAcceptData *data = (void *) epoll_data->data;
-
-    int client_fd = accept(epoll_data->fd, NULL, NULL);
-    if (client_fd == -1) {
-        if (errno == EAGAIN) return true;
-        runtime_error("Error in accept (%s)", strerror(errno));
-        return false;
+static IoStatus server_accept_callback(UNUSED(IoWaiter *waiter), ssize_t result, Value *value) {
+    if (result < 0) {
+        runtime_error("Error in accept (%s)", strerror(-result));
+        return IO_ERROR;
     }
+    int client_fd = (int) result;
     if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1) {
         runtime_error("Error in fcntl (%s)", strerror(errno));
-        return false;
+        return IO_ERROR;
     }
 
-    fulfill_promise(data->promise, VALUE_NUMBER(client_fd));
-    object_enable_gc((Object *) data->promise);
-    vm_epoll_delete(epoll_data);
-    return true;
+    *value = VALUE_NUMBER(client_fd);
+    return IO_DONE;
 }
 
 static bool server_accept(Value *result, Value *args) {
@@ -189,52 +191,29 @@ static bool server_accept(Value *result, Value *args) {
         runtime_error("The first argument must be a server");
         return false;
     }
-    int server_fd = (int) args[0].as.number;
+    int server_fd = (int) AS_NUMBER(args[0]);
 
     ObjPromise *promise = new_promise();
     *result = VALUE_OBJECT(promise);
 
-    int client_fd = accept(server_fd, NULL, NULL);
-    if (client_fd != -1) {
-        fulfill_promise(promise, VALUE_NUMBER(client_fd));
-        return true;
-    }
-
-    ServerAcceptData *data = vm_epoll_add(server_fd, EPOLLIN, &server_accept_callback, sizeof(ServerAcceptData));
-    data->promise = promise;
-
-    object_disable_gc((Object *) promise);
-    return true;
+    IoWaiter operation = {
+        .operation = IO_ACCEPT,
+        .fd = server_fd,
+        .callback = &server_accept_callback,
+        .promise = promise,
+    };
+    return vm_io_start(&operation);
 }
 
-typedef struct {
-    size_t length;
-    ObjString *string;
-    ObjPromise *promise;
-} SocketReadData;
-
-static bool socket_read_callback(EpollData *epoll_data) {
-    SocketReadData *data = (void *) epoll_data->data;
-
-    ssize_t bytes = read(epoll_data->fd, data->string->cstr, data->length);
-    if (bytes == -1) {
-        if (errno == EAGAIN) return true;
-
-        runtime_error("Error in read (%s)", strerror(errno));
-        return false;
-    }
-
-    if (bytes == 0) {
-        // Return nil on closed connection.
-        fulfill_promise(data->promise, VALUE_NIL());
-    } else {
-        fulfill_promise(data->promise, VALUE_OBJECT(finish_new_string(data->string, bytes)));
+static IoStatus socket_read_callback(IoWaiter *waiter, ssize_t result, Value *value) {
+    if (result < 0) {
+        runtime_error("Error in read (%s)", strerror(-result));
+        return IO_ERROR;
     }
 
-    object_enable_gc((Object *) data->promise);
-    object_enable_gc((Object *) data->string);
-    vm_epoll_delete(epoll_data);
-    return true;
+    // Return nil on closed connection.
+    *value = result == 0 ? VALUE_NIL() : VALUE_OBJECT(finish_new_string((ObjString *) waiter->buffer, result));
+    return IO_DONE;
 }
 
 static bool socket_read(Value *result, Value *args) {
@@ -246,61 +225,38 @@ static bool socket_read(Value *result, Value *args) {
         runtime_error("The second argument is length, it must be a positive integer.");
         return false;
     }
-    int fd = (int) args[0].as.number;
-    size_t length = (size_t) args[1].as.number;
+    int fd = (int) AS_NUMBER(args[0]);
+    size_t length = (size_t) AS_NUMBER(args[1]);
 
     ObjPromise *promise = new_promise();
+    // Keep the promise alive while allocating the string.
     object_disable_gc((Object *) promise);
     *result = VALUE_OBJECT(promise);
-
     ObjString *string = create_new_string(length);
-    ssize_t bytes = read(fd, string->cstr, length);
-    if (bytes != -1) {
-        if (bytes == 0) {
-            // Return nil on closed connection.
-            fulfill_promise(promise, VALUE_NIL());
-        } else {
-            fulfill_promise(promise, VALUE_OBJECT(finish_new_string(string, bytes)));
-        }
-        object_enable_gc((Object *) promise);
-        return true;
-    }
-
-    SocketReadData *data = vm_epoll_add(fd, EPOLLIN, &socket_read_callback, sizeof(SocketReadData));
-    data->length = length;
-    data->string = string;
-    data->promise = promise;
-
-    object_disable_gc((Object *) string);
-    return true;
+    object_enable_gc((Object *) promise);
+
+    IoWaiter operation = {
+        .operation = IO_RECV,
+        .fd = fd,
+        .data = string->cstr,
+        .length = length,
+        .callback = &socket_read_callback,
+        .promise = promise,
+        .buffer = (Object *) string,
+    };
+    return vm_io_start(&operation);
 }
 
-typedef struct {
-    ObjString *string;
-    uint32_t offset;
-    ObjPromise *promise;
-} SocketWriteData;
-
-static bool socket_write_callback(EpollData *epoll_data) {
-    SocketWriteData *data = (void *) epoll_data->data;
-
-    uint32_t length = data->string->length - data->offset;
-    ssize_t bytes = write(epoll_data->fd, data->string->cstr + data->offset, length);
-    if (bytes == -1) {
-        if (errno == EAGAIN) return true;
-        runtime_error("Error in write (%s)", strerror(errno));
-        return false;
-    }
-    if (bytes < length) {
-        data->offset += bytes;
-        return true;
+static IoStatus socket_write_callback(IoWaiter *waiter, ssize_t result, UNUSED(Value *value)) {
+    if (result < 0) {
+        runtime_error("Error in write (%s)", strerror(-result));
+        return IO_ERROR;
     }
 
-    fulfill_promise(data->promise, VALUE_NIL());
-    object_enable_gc((Object *) data->promise);
-    object_enable_gc((Object *) data->string);
-    vm_epoll_delete(epoll_data);
-    return true;
+    // Write the rest after a partial write.
+    waiter->data += result;
+    waiter->length -= result;
+    return waiter->length == 0 ? IO_DONE : IO_AGAIN;
 }
 
 static bool socket_write(Value *result, Value *args) {
@@ -312,32 +268,92 @@ static bool socket_write(Value *result, Value *args) {
         runtime_error("The second argument must be a string");
         return false;
     }
-    int fd = (int) args[0].as.number;
-    ObjString *string = (ObjString *) args[1].as.object;
+    int fd = (int) AS_NUMBER(args[0]);
+    ObjString *string = (ObjString *) AS_OBJECT(args[1]);
 
     ObjPromise *promise = new_promise();
     *result = VALUE_OBJECT(promise);
 
-    ssize_t bytes = write(fd, string->cstr, string->length);
-    // Ignore EAGAIN and setup epoll as if nothing was written.
-    if (bytes == -1 && errno == EAGAIN) bytes = 0;
-    if (bytes == -1) {
-        runtime_error("Error in write (%s)", strerror(errno));
+    IoWaiter operation = {
+        .operation = IO_SEND,
+        .fd = fd,
+        .data = string->cstr,
+        .length = string->length,
+        .callback = &socket_write_callback,
+        .promise = promise,
+        .buffer = (Object *) string,
+    };
+    return vm_io_start(&operation);
+}
+
+static IoStatus socket_send_file_callback(IoWaiter *waiter, ssize_t result, UNUSED(Value *value)) {
+    if (result < 0) {
+        runtime_error("Error in sendfile (%s)", strerror(-result));
+        return IO_ERROR;
+    }
+
+    // Send the rest after a partial write, the file may also have been truncated since the call.
+    waiter->offset += result;
+    waiter->length -= result;
+    return waiter->length == 0 || result == 0 ? IO_DONE : IO_AGAIN;
+}
+
+static bool socket_send_file(Value *result, Value *args) {
+    if (!check_int_arg(args[0], 0, INT_MAX)) {
+        runtime_error("The first argument must be a socket");
         return false;
     }
-    if (bytes == string->length) {
-        fulfill_promise(promise, VALUE_NIL());
-        return true;
+    if (!is_object_type(args[1], OBJ_STRING)) {
+        runtime_error("The second argument must be a path");
+        return false;
+    }
+    if (!check_int_arg(args[2], 0, INT64_MAX)) {
+        runtime_error("The third argument is offset, it must be a non-negative integer");
+        return false;
+    }
+    if (!IS_NIL(args[3]) && !check_int_arg(args[3], 0, INT64_MAX)) {
+        runtime_error("The fourth argument is length, it must be a non-negative integer or nil");
+        return false;
+    }
+    int fd = (int) AS_NUMBER(args[0]);
+    const char *path = ((ObjString *) AS_OBJECT(args[1]))->cstr;
+
+    int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (file_fd == -1 || fstat(file_fd, &file_stat) == -1) {
+        runtime_error("Error in socketSendFile: unable to open \"%s\" (%s)", path, strerror(errno));
+        if (file_fd != -1) close(file_fd);
+        return false;
     }
+    if (!S_ISREG(file_stat.st_mode)) {
+        runtime_error("Error in socketSendFile: \"%s\" is not a regular file", path);
+        close(file_fd);
+        return false;
+    }
+    // Compared as doubles, the offset and length are only converted once they are known to fit in the file.
+    if (AS_NUMBER(args[2]) > (double) file_stat.st_size) {
+        runtime_error("Error in socketSendFile: the offset is past the end of \"%s\"", path);
+        close(file_fd);
+        return false;
+    }
+    off_t offset = (off_t) AS_NUMBER(args[2]);
+    // Nil or a length past the end of the file sends the rest of the file.
+    size_t length = (size_t) (file_stat.st_size - offset);
+    if (!IS_NIL(args[3]) && AS_NUMBER(args[3]) < (double) length) length = (size_t) AS_NUMBER(args[3]);
 
-    SocketWriteData *data = vm_epoll_add(fd, EPOLLOUT, &socket_write_callback, sizeof(SocketWriteData));
-    data->offset = bytes;
-    data->string = string;
-    data->promise = promise;
+    ObjPromise *promise = new_promise();
+    *result = VALUE_OBJECT(promise);
 
-    object_disable_gc((Object *) promise);
-    object_disable_gc((Object *) string);
-    return true;
+    IoWaiter operation = {
+        .operation = IO_SENDFILE,
+        .fd = fd,
+        .length = length,
+        .callback = &socket_send_file_callback,
+        .promise = promise,
+        .file_fd = file_fd,
+        .offset = offset,
+    };
+    return vm_io_start(&operation);
 }
 
 static bool socket_close(Value *result, Value *args) {
@@ -345,25 +361,351 @@ static bool socket_close(Value *result, Value *args) {
         runtime_error("The first argument must be a socket");
         return false;
     }
-    int fd = (int) args[0].as.number;
+    int fd = (int) AS_NUMBER(args[0]);
 
     // https://blog.netherlabs.nl/articles/2009/01/18/the-ultimate-so_linger-page-or-why-is-my-tcp-not-reliable
     // Read pending data before closing to avoid sending RST.
     shutdown(fd, SHUT_WR);
     static char buffer[4096];
     while (read(fd, buffer, sizeof(buffer) / sizeof(*buffer)) > 0);
+    vm_io_close(fd);
     close(fd);
 
     *result = VALUE_NIL();
     return true;
 }
 
+// Reader buffers start this big and grow to fit the longest line or the largest exact read.
+#define READER_INITIAL_CAPACITY 4096
+
+static bool create_reader(Value *result, Value *args) {
+    if (is_object_type(args[0], OBJ_STRING)) {
+        const ObjString *source = (const ObjString *) AS_OBJECT(args[0]);
+        ObjReader *reader = new_reader(-1);
+        if (source->length > 0) {
+            object_disable_gc((Object *) reader);
+            reader->buffer = ARRAY_REALLOC(reader->buffer, 0, source->length);
+            object_enable_gc((Object *) reader);
+            memcpy(reader->buffer, source->cstr, source->length);
+            reader->capacity = reader->end = source->length;
+        }
+        reader->is_eof = true;
+        *result = VALUE_OBJECT(reader);
+        return true;
+    }
+    if (!check_int_arg(args[0], 0, INT_MAX)) {
+        runtime_error("The first argument must be a socket or a string");
+        return false;
+    }
+
+    *result = VALUE_OBJECT(new_reader((int) AS_NUMBER(args[0])));
+    return true;
+}
+
+// Looks for the delimiter in the unread data, skipping what earlier calls for the same read have already searched.
+static bool reader_find_delimiter(ObjReader *reader, uint32_t *position) {
+    const char *delimiter = reader->mode == READ_LINE ? "\n" : reader->delimiter->cstr;
+    uint32_t length = reader->mode == READ_LINE ? 1 : reader->delimiter->length;
+    uint32_t from = reader->scanned > reader->start ? reader->scanned : reader->start;
+    if (from == reader->end) return false;
+
+    const char *end = reader->buffer + reader->end;
+    for (const char *c = reader->buffer + from; (c = memchr(c, delimiter[0], end - c)) != NULL; c++) {
+        if ((size_t) (end - c) < length) break;
+        if (memcmp(c, delimiter, length) == 0) {
+            *position = (uint32_t) (c - reader->buffer);
+            return true;
+        }
+    }
+    // The last bytes may be the start of a delimiter that ends in data that hasn't been read yet.
+    reader->scanned = reader->end - from >= length ? reader->end - (length - 1) : from;
+    return false;
+}
+
+// Sets `value` to the result of the read if the buffered data is enough for it. After the connection was closed, the
+// rest of the data is the result, and nil once there is nothing left.
+static bool reader_take_request(ObjReader *reader, Value *value);
+
+static bool reader_take(ObjReader *reader, Value *value) {
+    if (reader->mode == READ_REQUEST) return reader_take_request(reader, value);
+
+    uint32_t available = reader->end - reader->start;
+    uint32_t length;
+    uint32_t consumed;
+    uint32_t position;
+    if (reader->mode == READ_EXACTLY) {
+        if (available < reader->wanted && !reader->is_eof) return false;
+        length = consumed = available < reader->wanted ? available : reader->wanted;
+    } else if (reader_find_delimiter(reader, &position)) {
+        length = position - reader->start;
+        consumed = length + (reader->mode == READ_LINE ? 1 : reader->delimiter->length);
+        if (reader->mode == READ_LINE && length > 0 && reader->buffer[position - 1] == '\r') length--;
+    } else if (reader->is_eof) {
+        length = consumed = available;
+    } else {
+        return false;
+    }
+
+    if (consumed == 0) {
+        // Reading no bytes always succeeds, other reads find nothing left once the connection is closed.
+        *value = reader->mode == READ_EXACTLY && reader->wanted == 0 ? VALUE_OBJECT(copy_string("", 0)) : VALUE_NIL();
+    } else {
+        *value = VALUE_OBJECT(copy_string(reader->buffer + reader->start, length));
+    }
+    reader->start += consumed;
+    if (reader->start == reader->end) reader->start = reader->end = 0;
+    reader->scanned = reader->start;
+    return true;
+}
+
+// Moves the unread data to the front of the buffer and grows it if there's no room to read more after it.
+static void reader_reserve(ObjReader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->scanned -= reader->start;
+        reader->start = 0;
+    }
+
+    uint32_t needed = reader->wanted > reader->end ? reader->wanted : reader->end + 1;
+    if (needed > reader->capacity) {
+        uint32_t capacity = GROW_CAPACITY(reader->capacity, READER_INITIAL_CAPACITY, 2);
+        if (capacity < needed) capacity = needed;
+        reader->buffer = ARRAY_REALLOC(reader->buffer, reader->capacity, capacity);
+        reader->capacity = capacity;
+    }
+}
+
+static IoStatus reader_callback(IoWaiter *waiter, ssize_t result, Value *value) {
+    ObjReader *reader = (ObjReader *) waiter->buffer;
+    if (result < 0) {
+        reader->is_reading = false;
+        runtime_error("Error in read (%s)", strerror(-result));
+        return IO_ERROR;
+    }
+
+    if (result == 0) reader->is_eof = true;
+    reader->end += (uint32_t) result;
+    if (reader_take(reader, value)) {
+        reader->is_reading = false;
+        return IO_DONE;
+    }
+
+    // Read more into the buffer, which may have moved.
+    reader_reserve(reader);
+    waiter->data = reader->buffer + reader->end;
+    waiter->length = reader->capacity - reader->end;
+    return IO_AGAIN;
+}
+
+// Returns a promise of the read, fulfilled right away when the buffered data is enough.
+static bool start_reader_read(Value *result, ObjReader *reader) {
+    ObjPromise *promise = new_promise();
+    // Keep the promise alive while allocating the result or growing the buffer.
+    object_disable_gc((Object *) promise);
+    *result = VALUE_OBJECT(promise);
+
+    Value value;
+    bool is_done = reader_take(reader, &value);
+    if (is_done) {
+        fulfill_promise(promise, value);
+    } else {
+        reader_reserve(reader);
+    }
+    object_enable_gc((Object *) promise);
+    if (is_done) return true;
+
+    reader->is_reading = true;
+    IoWaiter operation = {
+        .operation = IO_RECV,
+        .fd = reader->fd,
+        .data = reader->buffer + reader->end,
+        .length = reader->capacity - reader->end,
+        .callback = &reader_callback,
+        .promise = promise,
+        .buffer = (Object *) reader,
+    };
+    return vm_io_start(&operation);
+}
+
+static ObjReader *reader_arg(Value arg, const char *function) {
+    if (!is_object_type(arg, OBJ_READER)) {
+        runtime_error("The first argument must be a reader");
+        return NULL;
+    }
+    ObjReader *reader = (ObjReader *) AS_OBJECT(arg);
+    if (reader->is_reading) {
+        runtime_error("Error in %s: the reader is already waiting for data", function);
+        return NULL;
+    }
+    return reader;
+}
+
+static bool read_line(Value *result, Value *args) {
+    ObjReader *reader = reader_arg(args[0], "readLine");
+    if (reader == NULL) return false;
+
+    reader->mode = READ_LINE;
+    reader->delimiter = NULL;
+    reader->wanted = 0;
+    return start_reader_read(result, reader);
+}
+
+static bool read_until(Value *result, Value *args) {
+    ObjReader *reader = reader_arg(args[0], "readUntil");
+    if (reader == NULL) return false;
+    if (!is_object_type(args[1], OBJ_STRING) || ((ObjString *) AS_OBJECT(args[1]))->length == 0) {
+        runtime_error("The second argument is delimiter, it must be a non-empty string");
+        return false;
+    }
+
+    reader->mode = READ_UNTIL;
+    reader->delimiter = (ObjString *) AS_OBJECT(args[1]);
+    reader->wanted = 0;
+    return start_reader_read(result, reader);
+}
+
+static bool read_exactly(Value *result, Value *args) {
+    ObjReader *reader = reader_arg(args[0], "readExactly");
+    if (reader == NULL) return false;
+    if (!check_int_arg(args[1], 0, INT32_MAX)) {
+        runtime_error("The second argument is length, it must be a non-negative integer");
+        return false;
+    }
+
+    reader->mode = READ_EXACTLY;
+    reader->delimiter = NULL;
+    reader->wanted = (uint32_t) AS_NUMBER(args[1]);
+    return start_reader_read(result, reader);
+}
+
+// Sets a field of an instance that the caller keeps alive, the value is kept alive while the name is created.
+static void set_field_pinned(ObjInstance *instance, const char *name, Value value) {
+    if (IS_OBJECT(value)) object_disable_gc(AS_OBJECT(value));
+    ObjString *field = copy_string(name, strlen(name));
+    object_disable_gc((Object *) field);
+    instance_set_field(instance, field, value);
+    object_enable_gc((Object *) field);
+    if (IS_OBJECT(value)) object_enable_gc(AS_OBJECT(value));
+}
+
+// Header names are lowercased in the buffer, and repeated headers are combined into a comma-separated list.
+static void add_header(ObjInstance *headers, char *data, const HttpHeader *header) {
+    char *name_cstr = data + header->name.start;
+    for (uint32_t i = 0; i < header->name.length; i++) {
+        if (name_cstr[i] >= 'A' && name_cstr[i] <= 'Z') name_cstr[i] += 'a' - 'A';
+    }
+    ObjString *name = copy_string(name_cstr, header->name.length);
+    object_disable_gc((Object *) name);
+
+    const char *value_cstr = data + header->value.start;
+    Value previous;
+    ObjString *value;
+    if (instance_get_field(headers, name, &previous)) {
+        ObjString *first = (ObjString *) AS_OBJECT(previous);
+        uint32_t length = first->length + 2 + header->value.length;
+        char *joined = malloc(length);
+        if (joined == NULL) OUT_OF_MEMORY();
+        memcpy(joined, first->cstr, first->length);
+        memcpy(joined + first->length, ", ", 2);
+        memcpy(joined + first->length + 2, value_cstr, header->value.length);
+        value = copy_string(joined, length);
+        free(joined);
+    } else {
+        value = copy_string(value_cstr, header->value.length);
+    }
+    object_disable_gc((Object *) value);
+
+    instance_set_field(headers, name, VALUE_OBJECT(value));
+    object_enable_gc((Object *) value);
+    object_enable_gc((Object *) name);
+}
+
+static Value request_value(ObjReader *reader, const HttpRequest *request) {
+    char *data = reader->buffer + reader->start;
+
+    // Header names come from the client, so they are kept out of shapes, which are never freed.
+    ObjInstance *headers = new_dictionary_instance(vm.headers_class);
+    object_disable_gc((Object *) headers);
+    for (uint32_t i = 0; i < request->headers_length; i++) add_header(headers, data, &request->headers[i]);
+
+    ObjInstance *instance = new_instance(vm.request_class);
+    object_disable_gc((Object *) instance);
+    const HttpSpan *method = &request->method;
+    const HttpSpan *path = &request->path;
+    const HttpSpan *version = &request->version;
+    set_field_pinned(instance, "method", VALUE_OBJECT(copy_string(data + method->start, method->length)));
+    set_field_pinned(instance, "path", VALUE_OBJECT(copy_string(data + path->start, path->length)));
+    set_field_pinned(instance, "version", VALUE_OBJECT(copy_string(data + version->start, version->length)));
+    set_field_pinned(instance, "headers", VALUE_OBJECT(headers));
+    set_field_pinned(instance, "body", VALUE_OBJECT(copy_string(data + request->head_length, request->content_length)));
+    set_field_pinned(instance, "keepAlive", VALUE_BOOL(request->keep_alive));
+
+    object_enable_gc((Object *) instance);
+    object_enable_gc((Object *) headers);
+    return VALUE_OBJECT(instance);
+}
+
+// Takes the next request once all of it has arrived. An invalid request gives false, and the rest of the data is
+// dropped since the connection can't be used for more requests.
+static bool reader_take_request(ObjReader *reader, Value *value) {
+    // Empty lines before a request are ignored, some clients send them after the body of the previous one.
+    if (reader->scanned == reader->start) {
+        while (reader->start < reader->end && (reader->buffer[reader->start] == '\r'
+                                               || reader->buffer[reader->start] == '\n')) {
+            reader->start++;
+        }
+        reader->scanned = reader->start;
+    }
+
+    uint32_t available = reader->end - reader->start;
+    uint32_t scanned = reader->scanned - reader->start;
+    HttpRequest request;
+    HttpStatus status = available == 0 ? HTTP_INCOMPLETE
+                                       : http_parse_head(reader->buffer + reader->start, available, &scanned, &request);
+    reader->scanned = reader->start + scanned;
+
+    if (status == HTTP_COMPLETE) {
+        uint32_t length = request.head_length + request.content_length;
+        if (available >= length) {
+            *value = request_value(reader, &request);
+            reader->start += length;
+            if (reader->start == reader->end) reader->start = reader->end = 0;
+            reader->scanned = reader->start;
+            reader->wanted = 0;
+            return true;
+        }
+        // Makes room for the body before the next read.
+        reader->wanted = length;
+    } else if (status == HTTP_INVALID) {
+        *value = VALUE_BOOL(false);
+        reader->start = reader->end = reader->scanned = reader->wanted = 0;
+        return true;
+    }
+    if (!reader->is_eof) return false;
+
+    // The connection was closed before the whole request arrived, or between requests.
+    *value = VALUE_NIL();
+    reader->start = reader->end = reader->scanned = reader->wanted = 0;
+    return true;
+}
+
+static bool read_request(Value *result, Value *args) {
+    ObjReader *reader = reader_arg(args[0], "readRequest");
+    if (reader == NULL) return false;
+
+    reader->mode = READ_REQUEST;
+    reader->delimiter = NULL;
+    reader->wanted = 0;
+    return start_reader_read(result, reader);
+}
+
 static bool create_array(Value *result, Value *args) {
     if (!check_int_arg(args[0], 0, UINT32_MAX)) {
         runtime_error("The first argument is length, it must be a non-negative integer");
         return false;
     }
-    uint32_t size = (uint32_t) args[0].as.number;
+    uint32_t size = (uint32_t) AS_NUMBER(args[0]);
 
     *result = VALUE_OBJECT(new_array(size, args[1]));
     return true;
@@ -372,22 +714,29 @@ static bool create_array(Value *result, Value *args) {
 static NativeFunctionDef functions[] = {
     // clang-format off
     // time
-    { "clock",         0,     clock_        },
-    { "sleep",         1,     sleep_        },
+    { "clock",           0,     clock_,            false },
+    { "sleep",           1,     sleep_,            true  },
     // instance
-    { "hasField",      2,     has_field     },
-    { "getField",      2,     get_field     },
-    { "setField",      3,     set_field     },
-    { "deleteField",   2,     delete_field  },
+    { "hasField",        2,     has_field,         false },
+    { "getField",        2,     get_field,         false },
+    { "setField",        3,     set_field,         false },
+    { "deleteField",     2,     delete_field,      false },
     // net
-    { "createServer",  0,     create_server },
-    { "serverListen",  2,     server_listen },
-    { "serverAccept",  1,     server_accept },
-    { "socketRead",    2,     socket_read   },
-    { "socketWrite",   2,     socket_write  },
-    { "socketClose",   1,     socket_close  },
+    { "createServer",    0,     create_server,     false },
+    { "serverListen",    2,     server_listen,     false },
+    { "serverAccept",    1,     server_accept,     false },
+    { "socketRead",      2,     socket_read,       false },
+    { "socketWrite",     2,     socket_write,      false },
+    { "socketSendFile",  4,     socket_send_file,  false },
+    { "socketClose",     1,     socket_close,      false },
+    // reader
+    { "createReader",    1,     create_reader,     false },
+    { "readLine",        1,     read_line,         false },
+    { "readUntil",       2,     read_until,        false },
+    { "readExactly",     2,     read_exactly,      false },
+    { "readRequest",     1,     read_request,      false },
     // array
-    { "Array",         2,     create_array  },
+    { "Array",           2,     create_array,      false },
     // clang-format on
 };
 
@@ -395,6 +744,7 @@ void add_native_functions(void) {
     for (size_t i = 0; i < sizeof(functions) / sizeof(*functions); i++) {
         ObjString *name = copy_string(functions[i].name, strlen(functions[i].name));
         Value function = VALUE_OBJECT(new_native(functions[i]));
-        hashmap_set(&vm.globals, name, function);
+        uint32_t slot = global_slot(name);
+        vm.globals.values[slot] = function;
     }
 }
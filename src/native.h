@@ -9,6 +9,8 @@ typedef struct {
     const char *name;
     uint8_t arity;
     NativeFn function;
+    // Whether the function may suspend the calling coroutine.
+    bool suspends;
 } NativeFunctionDef;
 
 // Creates native functions and adds to VM's globals.
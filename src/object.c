@@ -7,6 +7,8 @@
 #include "memory.h"
 #include "vm.h"
 
+#define SHAPE_NAME_BIT(name) ((uint64_t) 1 << ((name)->hash & 63))
+
 #ifdef INLINE_CACHING
 cache_id_t next_id(void) {
     // Ids start at 1 to reserve 0 for uninitialized cached.
@@ -23,7 +25,9 @@ const char *object_to_temp_cstr(const Object *object) {
 
     switch (object->type) {
         case OBJ_UPVALUE:  return "upvalue";
+        case OBJ_SHAPE:    return "shape";
         case OBJ_PROMISE:  return "<Promise>";
+        case OBJ_READER:   return "<Reader>";
         case OBJ_STRING:   return ((const ObjString *) object)->cstr;
         case OBJ_CLASS:    return ((const ObjClass *) object)->name->cstr;
         case OBJ_FUNCTION: {
@@ -105,8 +109,12 @@ void free_object(Object *object) {
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            free_hashmap(&instance->fields);
-            FREE(object, sizeof(ObjInstance));
+            if (instance->shape == NULL) {
+                free_hashmap(&instance->fields.dictionary);
+            } else {
+                ARRAY_FREE(instance->fields.overflow, instance->overflow_capacity);
+            }
+            FREE(object, sizeof(ObjInstance) + sizeof(*instance->inline_fields) * instance->inline_capacity);
         } break;
         case OBJ_BOUND_METHOD: FREE(object, sizeof(ObjBoundMethod)); break;
         case OBJ_PROMISE:      FREE(object, sizeof(ObjPromise)); break;
@@ -114,6 +122,17 @@ void free_object(Object *object) {
             ObjArray *array = (ObjArray *) object;
             FREE(object, sizeof(ObjArray) + sizeof(*array->elements) * array->length);
         } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            free_hashmap(&shape->transitions);
+            free_hashmap(&shape->slots);
+            FREE(object, sizeof(ObjShape));
+        } break;
+        case OBJ_READER: {
+            ObjReader *reader = (ObjReader *) object;
+            ARRAY_FREE(reader->buffer, reader->capacity);
+            FREE(object, sizeof(ObjReader));
+        } break;
         default: UNREACHABLE();
     }
 }
@@ -137,6 +156,7 @@ ObjFunction *new_function(ObjString *name, bool is_async) {
     function->is_async = is_async;
     function->arity = 0;
     function->upvalues_count = 0;
+    function->max_depth = 0;
     function->chunk = (Chunk) {0};
     return function;
 }
@@ -162,6 +182,7 @@ ObjNative *new_native(NativeFunctionDef definition) {
     native->name = definition.name;
     native->arity = definition.arity;
     native->function = definition.function;
+    native->suspends = definition.suspends;
     return native;
 }
 
@@ -169,16 +190,38 @@ ObjClass *new_class(ObjString *name) {
     ObjClass *class = (ObjClass *) new_object(OBJ_CLASS, sizeof(ObjClass));
     class->name = name;
     class->methods = (HashMap) {0};
+    class->root_shape = NULL;
+    class->fields_hint = 0;
 #ifdef INLINE_CACHING
     class->id = next_id();
 #endif
+
+    stack_push(VALUE_OBJECT(class));
+    class->root_shape = new_shape(NULL, NULL);
+    stack_pop();
+
     return class;
 }
 
 ObjInstance *new_instance(ObjClass *class) {
+    uint32_t inline_capacity = class->fields_hint;
+    ObjInstance *instance = (ObjInstance *) new_object(
+        OBJ_INSTANCE, sizeof(ObjInstance) + sizeof(*instance->inline_fields) * inline_capacity);
+    instance->class = class;
+    instance->shape = class->root_shape;
+    instance->inline_capacity = inline_capacity;
+    instance->overflow_capacity = 0;
+    instance->fields.overflow = NULL;
+    return instance;
+}
+
+ObjInstance *new_dictionary_instance(ObjClass *class) {
     ObjInstance *instance = (ObjInstance *) new_object(OBJ_INSTANCE, sizeof(ObjInstance));
     instance->class = class;
-    instance->fields = (HashMap) {0};
+    instance->shape = NULL;
+    instance->inline_capacity = 0;
+    instance->overflow_capacity = 0;
+    instance->fields.dictionary = (HashMap) {0};
     return instance;
 }
 
@@ -189,6 +232,20 @@ ObjBoundMethod *new_bound_method(Value instance, ObjClosure *method) {
     return bound_method;
 }
 
+ObjShape *new_shape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = (ObjShape *) new_object(OBJ_SHAPE, sizeof(ObjShape));
+    shape->parent = parent;
+    shape->name = name;
+    shape->length = parent == NULL ? 0 : parent->length + 1;
+    shape->names_filter = parent == NULL ? 0 : parent->names_filter | SHAPE_NAME_BIT(name);
+    shape->transitions = (HashMap) {0};
+    shape->slots = (HashMap) {0};
+#ifdef INLINE_CACHING
+    shape->id = next_id();
+#endif
+    return shape;
+}
+
 ObjPromise *new_promise(void) {
     ObjPromise *promise = (ObjPromise *) new_object(OBJ_PROMISE, sizeof(ObjPromise));
     promise->is_fulfilled = false;
@@ -205,6 +262,31 @@ ObjArray *new_array(uint32_t size, Value fill_value) {
     return array;
 }
 
+ObjReader *new_reader(int fd) {
+    ObjReader *reader = (ObjReader *) new_object(OBJ_READER, sizeof(ObjReader));
+    reader->fd = fd;
+    reader->is_eof = false;
+    reader->is_reading = false;
+    reader->buffer = NULL;
+    reader->start = 0;
+    reader->end = 0;
+    reader->capacity = 0;
+    reader->mode = READ_LINE;
+    reader->delimiter = NULL;
+    reader->wanted = 0;
+    reader->scanned = 0;
+    return reader;
+}
+
+// The table keeps strings only until they are collected. Collecting before it would grow turns the strings that became
+// garbage into tombstones, otherwise they could fill it up between collections and make it double every time.
+static void intern_string(ObjString *string) {
+    stack_push(VALUE_OBJECT(string));
+    if (hashmap_is_full(&vm.strings)) collect_garbage();
+    hashmap_set(&vm.strings, string, VALUE_NIL());
+    stack_pop();
+}
+
 ObjString *copy_string(const char *cstr, uint32_t length) {
     uint32_t hash = hash_string(cstr, length);
     ObjString *interned_string = hashmap_find_key(&vm.strings, cstr, length, hash);
@@ -216,9 +298,7 @@ ObjString *copy_string(const char *cstr, uint32_t length) {
     string->cstr[length] = '\0';
     string->length = length;
 
-    stack_push(VALUE_OBJECT(string));
-    hashmap_set(&vm.strings, string, VALUE_NIL());
-    stack_pop();
+    intern_string(string);
 
     return string;
 }
@@ -242,9 +322,7 @@ ObjString *concat_strings(const ObjString *a, const ObjString *b) {
     ObjString *interned_string = hashmap_find_key(&vm.strings, string->cstr, string->length, string->hash);
     if (interned_string != NULL) return interned_string;
 
-    stack_push(VALUE_OBJECT(string));
-    hashmap_set(&vm.strings, string, VALUE_NIL());
-    stack_pop();
+    intern_string(string);
 
     return string;
 }
@@ -266,12 +344,97 @@ ObjString *finish_new_string(ObjString *string, uint32_t length) {
     ObjString *interned_string = hashmap_find_key(&vm.strings, string->cstr, length, string->hash);
     if (interned_string != NULL) return interned_string;
 
-    stack_push(VALUE_OBJECT(string));
-    hashmap_set(&vm.strings, string, VALUE_NIL());
-    stack_pop();
+    intern_string(string);
     return string;
 }
 
+int32_t shape_find_slot(ObjShape *shape, const ObjString *name) {
+    if (!(shape->names_filter & SHAPE_NAME_BIT(name))) return -1;
+
+    if (shape->length > SHAPE_LINEAR_LOOKUP_MAX) {
+        Value slot;
+        if (!hashmap_get(&shape->slots, name, &slot)) return -1;
+        return (int32_t) AS_NUMBER(slot);
+    }
+
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) return (int32_t) shape->length - 1;
+    }
+    return -1;
+}
+
+// Returns the child shape with the field added, creating it on the first transition.
+static ObjShape *shape_add_field(ObjShape *shape, ObjString *name) {
+    Value child_value;
+    if (hashmap_get(&shape->transitions, name, &child_value)) return (ObjShape *) AS_OBJECT(child_value);
+
+    ObjShape *child = new_shape(shape, name);
+    stack_push(VALUE_OBJECT(child));
+    hashmap_set(&shape->transitions, name, VALUE_OBJECT(child));
+    stack_pop();
+
+    // Reachable through the parent from now on.
+    if (child->length > SHAPE_LINEAR_LOOKUP_MAX) {
+        for (ObjShape *current = child; current->parent != NULL; current = current->parent) {
+            hashmap_set(&child->slots, current->name, VALUE_NUMBER(current->length - 1));
+        }
+    }
+
+    return child;
+}
+
+static void instance_to_dictionary(ObjInstance *instance) {
+    HashMap dictionary = {0};
+    // Fields stay in slots while the dictionary is filled, so GC can still reach them.
+    for (ObjShape *shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+        hashmap_set(&dictionary, shape->name, *instance_slot(instance, shape->length - 1));
+    }
+
+    ARRAY_FREE(instance->fields.overflow, instance->overflow_capacity);
+    instance->overflow_capacity = 0;
+    instance->shape = NULL;
+    instance->fields.dictionary = dictionary;
+}
+
+bool instance_set_field(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->shape == NULL) return hashmap_set(&instance->fields.dictionary, name, value);
+
+    int32_t slot = shape_find_slot(instance->shape, name);
+    if (slot != -1) {
+        *instance_slot(instance, slot) = value;
+        return false;
+    }
+
+    if (instance->shape->length == SHAPE_MAX_LENGTH) {
+        instance_to_dictionary(instance);
+        return hashmap_set(&instance->fields.dictionary, name, value);
+    }
+
+    ObjShape *shape = shape_add_field(instance->shape, name);
+    uint32_t new_slot = shape->length - 1;
+
+    if (new_slot >= instance->inline_capacity + instance->overflow_capacity) {
+        uint32_t new_capacity = GROW_CAPACITY(instance->overflow_capacity, 4, 2);
+        instance->fields.overflow = ARRAY_REALLOC(instance->fields.overflow, instance->overflow_capacity, new_capacity);
+        instance->overflow_capacity = new_capacity;
+    }
+
+    instance->shape = shape;
+    *instance_slot(instance, new_slot) = value;
+    if (shape->length > instance->class->fields_hint) instance->class->fields_hint = shape->length;
+
+    return true;
+}
+
+bool instance_delete_field(ObjInstance *instance, const ObjString *name) {
+    if (instance->shape != NULL) {
+        if (shape_find_slot(instance->shape, name) == -1) return false;
+        instance_to_dictionary(instance);
+    }
+
+    return hashmap_delete(&instance->fields.dictionary, name);
+}
+
 void object_disable_gc(Object *object) {
     if (vm.pinned_length >= vm.pinned_capacity) {
         vm.pinned_capacity = OBJECTS_GROW_CAPACITY(vm.pinned_capacity);
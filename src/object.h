@@ -17,6 +17,8 @@ typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_PROMISE,
     OBJ_ARRAY,
+    OBJ_SHAPE,
+    OBJ_READER,
 } ObjectType;
 
 typedef struct Object {
@@ -39,6 +41,8 @@ typedef struct {
     bool is_async;
     uint8_t arity;
     uint32_t upvalues_count;
+    // Most values a frame of the function has on the stack at once, counted from its callee slot.
+    uint32_t max_depth;
     Chunk chunk;
 } ObjFunction;
 
@@ -61,21 +65,58 @@ typedef struct {
     const char *name;
     uint8_t arity;
     NativeFn function;
+    bool suspends;
 } ObjNative;
 
+// Shapes with more fields look up slots in `slots` instead of walking up the parents.
+#define SHAPE_LINEAR_LOOKUP_MAX 8
+// Instances that would need more fields switch to dictionary mode.
+#define SHAPE_MAX_LENGTH 64
+
+// Layout of instance fields. Instances that had the same fields added in the same order share the shape.
+typedef struct ObjShape {
+    Object object;
+    // Shape without the last field, NULL for the root shape of a class.
+    struct ObjShape *parent;
+    // Name of the last field, it's stored at slot `length - 1`.
+    ObjString *name;
+    uint32_t length;
+    // Bit `hash % 64` is set for every field name, so most lookups of missing fields (like methods) stop early.
+    uint64_t names_filter;
+    // Field name to the shape with that field added.
+    HashMap transitions;
+    // Field name to slot, only filled for shapes longer than `SHAPE_LINEAR_LOOKUP_MAX`.
+    HashMap slots;
+#ifdef INLINE_CACHING
+    uint32_t id;
+#endif
+} ObjShape;
+
 typedef struct {
     Object object;
     ObjString *name;
     HashMap methods;
+    ObjShape *root_shape;
+    // Number of inline field slots for new instances, grows to the most fields seen on an instance.
+    uint32_t fields_hint;
 #ifdef INLINE_CACHING
-    uint16_t id;
+    uint32_t id;
 #endif
 } ObjClass;
 
 typedef struct {
     Object object;
     ObjClass *class;
-    HashMap fields;
+    // NULL if the instance is in dictionary mode.
+    ObjShape *shape;
+    uint32_t inline_capacity;
+    uint32_t overflow_capacity;
+    union {
+        // Slots that don't fit inline, slot `i` is at `i - inline_capacity`.
+        Value *overflow;
+        HashMap dictionary;
+    } fields;
+    Value inline_fields[];
 } ObjInstance;
 
 typedef struct {
@@ -104,11 +145,60 @@ typedef struct {
     Value elements[];
 } ObjArray;
 
+typedef enum {
+    READ_LINE,
+    READ_UNTIL,
+    READ_EXACTLY,
+    READ_REQUEST,
+} ReadMode;
+
+// Buffered reader of a socket. Unread data is kept in `buffer[start..end)` and moved to the front when the buffer
+// fills up, so delimiters are found with a single memchr over contiguous memory.
+typedef struct {
+    Object object;
+    // -1 for readers of a string, which start with all of it in the buffer like a closed connection.
+    int fd;
+    // Set once the connection is closed, the rest of the buffer can still be read.
+    bool is_eof;
+    // Only one read may wait for data at a time.
+    bool is_reading;
+    char *buffer;
+    uint32_t start;
+    uint32_t end;
+    uint32_t capacity;
+    // What the waiting read needs, and how far the buffer has already been searched for the delimiter or the end of the
+    // request head. `wanted` is the length of an exact read, or of a request once its head has been parsed.
+    ReadMode mode;
+    ObjString *delimiter;
+    uint32_t wanted;
+    uint32_t scanned;
+} ObjReader;
+
 #ifdef INLINE_CACHING
-typedef uint16_t cache_id_t;
-#define CACHE_ID_MAX UINT16_MAX
+typedef uint32_t cache_id_t;
+#define CACHE_ID_MAX UINT32_MAX
 
-// Id to compare classes in inline cache.
+// Inline cache of `OP_GET_FIELD` and `OP_SET_FIELD`, valid for instances with the shape `shape_id`.
+typedef struct {
+    cache_id_t shape_id;
+    uint32_t slot;
+    union {
+        // Get: if not NULL, the property is this method bound to the instance instead of the slot.
+        ObjClosure *method;
+        // Set: if not NULL, the field is new and the instance transitions to this shape.
+        ObjShape *transition;
+    } as;
+} PropertyCache;
+
+#define INVOKE_CACHE_SIZE 4
+
+// Polymorphic inline cache of `OP_INVOKE`, entry `i` calls `methods[i]` for instances with the shape `shape_ids[i]`.
+typedef struct {
+    cache_id_t shape_ids[INVOKE_CACHE_SIZE];
+    ObjClosure *methods[INVOKE_CACHE_SIZE];
+} InvokeCache;
+
+// Id to compare classes and shapes in inline cache.
 cache_id_t next_id(void);
 #endif
 
@@ -120,9 +210,13 @@ ObjClosure *new_closure(ObjFunction *function);
 ObjNative *new_native(NativeFunctionDef definition);
 ObjClass *new_class(ObjString *name);
 ObjInstance *new_instance(ObjClass *class);
+// Instance in dictionary mode from the start, for fields named by data that would otherwise add shapes without bound.
+ObjInstance *new_dictionary_instance(ObjClass *class);
 ObjBoundMethod *new_bound_method(Value instance, ObjClosure *method);
+ObjShape *new_shape(ObjShape *parent, ObjString *name);
 ObjPromise *new_promise(void);
 ObjArray *new_array(uint32_t size, Value fill_value);
+ObjReader *new_reader(int fd);
 ObjString *copy_string(const char *cstr, uint32_t length);
 ObjString *concat_strings(const ObjString *a, const ObjString *b);
 // Create a new string of the given length for callee to fill `cstr`.
@@ -131,13 +225,34 @@ ObjString *create_new_string(uint32_t capacity);
 // Finishes string creation by setting length, hash and interning it.
 // Returns interned string or the same one.
 ObjString *finish_new_string(ObjString *string, uint32_t length);
+// Returns the slot of the field or -1 if the shape doesn't have it.
+int32_t shape_find_slot(ObjShape *shape, const ObjString *name);
+// Returns true if the field is new. Instance and value must be reachable, since it may trigger GC.
+bool instance_set_field(ObjInstance *instance, ObjString *name, Value value);
+// Switches the instance to dictionary mode, returns false if there was no such field.
+bool instance_delete_field(ObjInstance *instance, const ObjString *name);
 // Prevents GC from freeing it by adding to the list of `pinned_objects`.
 void object_disable_gc(Object *object);
 // Decrements pin count, when it hits 0 it's marked for removal from `pinned_objects` during GC.
 void object_enable_gc(Object *object);
 
+static inline Value *instance_slot(ObjInstance *instance, uint32_t slot) {
+    if (slot < instance->inline_capacity) return &instance->inline_fields[slot];
+    return &instance->fields.overflow[slot - instance->inline_capacity];
+}
+
+static inline bool instance_get_field(ObjInstance *instance, const ObjString *name, Value *value) {
+    if (instance->shape == NULL) return hashmap_get(&instance->fields.dictionary, name, value);
+
+    int32_t slot = shape_find_slot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = *instance_slot(instance, slot);
+    return true;
+}
+
 static inline bool is_object_type(Value value, ObjectType type) {
-    return value.type == VAL_OBJECT && value.as.object->type == type;
+    return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
 }
 
 #endif  // CLOX_OBJECT_H_
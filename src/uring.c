@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef IO_URING
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "error.h"
+
+static int io_uring_setup(uint32_t entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void *arg,
+                          size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+bool uring_init(Uring *ring, uint32_t entries) {
+    struct io_uring_params params = {0};
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd == -1) return false;
+
+    // Timeouts are passed to `io_uring_enter` directly, operations on sockets that aren't ready wait inside the
+    // kernel, and completions are never dropped.
+    uint32_t features = IORING_FEAT_EXT_ARG | IORING_FEAT_FAST_POLL | IORING_FEAT_NODROP;
+    if ((params.features & features) != features) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        PANIC("Error in mmap: %s", strerror(errno));
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_mask = *(uint32_t *) (sq + params.sq_off.ring_mask);
+    ring->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    ring->sq_array = (uint32_t *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending = 0;
+
+    char *cq = ring->cq_ring;
+    ring->cq_mask = *(uint32_t *) (cq + params.cq_off.ring_mask);
+    ring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+void uring_free(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static void submit(Uring *ring, uint32_t min_complete, uint32_t flags, void *arg, size_t arg_size) {
+    int submitted = io_uring_enter(ring->fd, ring->sq_pending, min_complete, flags, arg, arg_size);
+    if (submitted >= 0) {
+        ring->sq_pending -= submitted;
+        return;
+    }
+    // Timing out and being interrupted only end the wait. The kernel is busy when completions must be consumed first,
+    // the pending entries are submitted next time.
+    if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) return;
+    PANIC("Error in io_uring_enter: %s", strerror(errno));
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    if (ring->sq_pending == ring->sq_entries) submit(ring, 0, 0, NULL, 0);
+    if (ring->sq_pending == ring->sq_entries) PANIC("The io_uring submission queue is full");
+
+    // Only this thread writes the tail, the kernel reads it once entries are submitted.
+    uint32_t tail = *ring->sq_tail;
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+void uring_enter(Uring *ring, uint64_t timeout_ns) {
+    if (timeout_ns == 0) {
+        if (ring->sq_pending > 0) submit(ring, 0, 0, NULL, 0);
+        return;
+    }
+
+    struct __kernel_timespec ts = {.tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000};
+    struct io_uring_getevents_arg arg = {.ts = timeout_ns == UINT64_MAX ? 0 : (uint64_t) (uintptr_t) &ts};
+    submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    uint32_t head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,42 @@
+#ifndef CLOX_URING_H_
+#define CLOX_URING_H_
+
+#include "common.h"
+
+#ifdef IO_URING
+#include <linux/io_uring.h>
+
+// Submission and completion queues shared with the kernel, set up with raw syscalls.
+typedef struct {
+    int fd;
+    uint32_t sq_mask;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    // Entries filled in since the last `io_uring_enter`.
+    uint32_t sq_pending;
+    uint32_t sq_entries;
+    uint32_t cq_mask;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+// Returns false when the kernel has no io_uring, or lacks a feature that's needed.
+bool uring_init(Uring *ring, uint32_t entries);
+void uring_free(Uring *ring);
+// Returns a zeroed submission entry, submitting the pending ones first if the queue is full.
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+// Submits pending entries and waits up to `timeout_ns` (UINT64_MAX is forever) for at least one completion.
+void uring_enter(Uring *ring, uint64_t timeout_ns);
+// Returns the next completion or NULL, it must be consumed with `uring_cqe_seen` before the next call.
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+#endif
+
+#endif  // CLOX_URING_H_
@@ -5,30 +5,27 @@
 #include "object.h"
 
 bool check_int_arg(Value arg, double min, double max) {
-    if (arg.type != VAL_NUMBER) return false;
+    if (!IS_NUMBER(arg)) return false;
 
     double temp;
-    double number = arg.as.number;
+    double number = AS_NUMBER(arg);
     return (min <= number && number <= max) && modf(number, &temp) == 0.0;
 }
 
 const char *value_to_temp_cstr(Value value) {
     static char CSTR[1024];
 
-    switch (value.type) {
-        case VAL_NIL:    return "nil";
-        case VAL_BOOL:   return value.as.boolean ? "true" : "false";
-        case VAL_NUMBER: {
-            int length = snprintf(CSTR, sizeof(CSTR), "%.10f", value.as.number);
-            // Remove trailing zeroes
-            while (CSTR[length - 1] == '0') length--;
-            if (CSTR[length - 1] == '.') length--;
-            CSTR[length] = '\0';
-            return CSTR;
-        }
-        case VAL_OBJECT: return object_to_temp_cstr(value.as.object);
-        default:         UNREACHABLE();
-    }
+    if (IS_NIL(value)) return "nil";
+    if (IS_BOOL(value)) return AS_BOOL(value) ? "true" : "false";
+    if (IS_OBJECT(value)) return object_to_temp_cstr(AS_OBJECT(value));
+    if (!IS_NUMBER(value)) UNREACHABLE();
+
+    int length = snprintf(CSTR, sizeof(CSTR), "%.10f", AS_NUMBER(value));
+    // Remove trailing zeroes
+    while (CSTR[length - 1] == '0') length--;
+    if (CSTR[length - 1] == '.') length--;
+    CSTR[length] = '\0';
+    return CSTR;
 }
 
 void values_push(ValueVec *vec, Value value) {
@@ -42,20 +39,24 @@ void values_push(ValueVec *vec, Value value) {
 }
 
 bool value_is_truthy(Value value) {
-    switch (value.type) {
-        case VAL_NIL:  return false;
-        case VAL_BOOL: return value.as.boolean;
-        default:       return true;
-    }
+    if (IS_NIL(value)) return false;
+    if (IS_BOOL(value)) return AS_BOOL(value);
+    return true;
 }
 
 bool value_equals(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN and 0 == -0, everything else is equal only if bits are equal.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_NIL:    return true;
-        case VAL_BOOL:   return a.as.boolean == b.as.boolean;
-        case VAL_NUMBER: return a.as.number == b.as.number;
-        case VAL_OBJECT: return a.as.object == b.as.object;
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b);
         default:         UNREACHABLE();
     }
+#endif
 }
@@ -3,14 +3,35 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include "common.h"
 
 typedef struct Object Object;
 
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles. Other values live in the payload of a quiet NaN, which no arithmetic
+// produces: objects have the sign bit set and the pointer in the low 48 bits, nil and booleans use small tags.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+// Marks global variable slots that are not defined yet, it is never visible to programs.
+#define TAG_UNDEFINED 4
+
+#else
+
 typedef enum {
     VAL_NIL = 0,
     VAL_BOOL,
     VAL_NUMBER,
     VAL_OBJECT,
+    // Marks global variable slots that are not defined yet, it is never visible to programs.
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -22,16 +43,63 @@ typedef struct {
     } as;
 } Value;
 
+#endif
+
 typedef struct {
     uint32_t capacity;
     uint32_t length;
     Value *values;
 } ValueVec;
 
+#ifdef NAN_BOXING
+
+static inline Value value_from_number(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(number));
+    return value;
+}
+
+static inline double value_to_number(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(value));
+    return number;
+}
+
+#define VALUE_NIL() ((Value) (QNAN | TAG_NIL))
+#define VALUE_BOOL(value) ((Value) (QNAN | ((value) ? TAG_TRUE : TAG_FALSE)))
+#define VALUE_NUMBER(value) value_from_number(value)
+#define VALUE_OBJECT(value) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (value)))
+#define VALUE_UNDEFINED() ((Value) (QNAN | TAG_UNDEFINED))
+
+#define IS_NIL(value) ((value) == VALUE_NIL())
+#define IS_BOOL(value) (((value) | 1) == (QNAN | TAG_TRUE))
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJECT(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+#define IS_UNDEFINED(value) ((value) == VALUE_UNDEFINED())
+
+#define AS_BOOL(value) ((value) == (QNAN | TAG_TRUE))
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_OBJECT(value) ((Object *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#else
+
 #define VALUE_NIL() ((Value) {.type = VAL_NIL})
 #define VALUE_BOOL(value) ((Value) {.type = VAL_BOOL, .as.boolean = (value)})
 #define VALUE_NUMBER(value) ((Value) {.type = VAL_NUMBER, .as.number = (value)})
 #define VALUE_OBJECT(value) ((Value) {.type = VAL_OBJECT, .as.object = (Object *) (value)})
+#define VALUE_UNDEFINED() ((Value) {.type = VAL_UNDEFINED})
+
+#define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_BOOL(value) ((value).type == VAL_BOOL)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
+#define AS_BOOL(value) ((value).as.boolean)
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_OBJECT(value) ((value).as.object)
+
+#endif
 
 bool check_int_arg(Value arg, double min, double max);
 const char *value_to_temp_cstr(Value value);
@@ -2,9 +2,14 @@
 #include "vm.h"
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -19,10 +24,10 @@
 
 VM vm = {0};
 
-uint64_t get_time_ms(void) {
+uint64_t get_time_ns(void) {
     struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) PANIC("Error in clock_gettime: %s", strerror(errno));
-    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) PANIC("Error in clock_gettime: %s", strerror(errno));
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -59,7 +64,7 @@ void runtime_error(const char *fmt, ...) {
 }
 
 static void coroutine_stack_push(Coroutine *coroutine, Value value) {
-    assert(coroutine->stack_top - coroutine->stack < STACK_SIZE && "Stack overflow");
+    assert(coroutine->stack_top < coroutine->stack_end && "Stack overflow");
     *(coroutine->stack_top++) = value;
 }
 
@@ -70,27 +75,110 @@ Value stack_pop(void) {
     return *(--vm.coroutine->stack_top);
 }
 
-void stack_popn(uint8_t n) {
-    vm.coroutine->stack_top -= n;
-    assert(vm.coroutine->stack_top >= vm.coroutine->stack && "Stack underflow");
-}
-
 Value stack_peek(uint32_t distance) {
     assert(distance < vm.coroutine->stack_top - vm.coroutine->stack && "Peek distance points outside of stack");
     return *(vm.coroutine->stack_top - distance - 1);
 }
 
+// Returns the slot of a global variable, reserving an undefined one if the name is seen for the first time.
+uint32_t global_slot(ObjString *name) {
+    Value slot;
+    if (hashmap_get(&vm.global_slots, name, &slot)) return AS_NUMBER(slot);
+
+    stack_push(VALUE_OBJECT(name));
+    uint32_t index = vm.globals.length;
+    values_push(&vm.globals, VALUE_UNDEFINED());
+    hashmap_set(&vm.global_slots, name, VALUE_NUMBER(index));
+    stack_pop();
+    return index;
+}
+
+// Slow reverse lookup, only used for error messages and disassembly.
+ObjString *global_name(uint32_t slot) {
+    for (uint32_t i = 0; i < vm.global_slots.capacity; i++) {
+        Entry *entry = &vm.global_slots.entries[i];
+        if (entry->key != NULL && AS_NUMBER(entry->value) == slot) return entry->key;
+    }
+    UNREACHABLE();
+}
+
 static Coroutine *new_coroutine(void) {
-    Coroutine *coroutine = malloc(sizeof(*coroutine));
-    if (coroutine == NULL) OUT_OF_MEMORY();
+    Coroutine *coroutine = vm.pooled_head;
+    if (coroutine != NULL) {
+        vm.pooled_head = coroutine->next;
+        vm.pooled_count--;
+    } else {
+        coroutine = malloc(sizeof(*coroutine));
+        CallFrame *frames = malloc(sizeof(*frames) * CALLSTACK_INITIAL_SIZE);
+        Value *stack = malloc(sizeof(*stack) * STACK_INITIAL_SIZE);
+        if (coroutine == NULL || frames == NULL || stack == NULL) OUT_OF_MEMORY();
+        coroutine->frames = frames;
+        coroutine->frames_end = frames + CALLSTACK_INITIAL_SIZE;
+        coroutine->stack = stack;
+        coroutine->stack_end = stack + STACK_INITIAL_SIZE;
+    }
+
     coroutine->prev = NULL;
     coroutine->next = NULL;
-    coroutine->promise = new_promise();
+    coroutine->promise = NULL;
     coroutine->frame = NULL;
     coroutine->stack_top = coroutine->stack;
+    coroutine->open_upvalues = NULL;
     return coroutine;
 }
 
+static void free_coroutine(Coroutine *coroutine) {
+    free(coroutine->frames);
+    free(coroutine->stack);
+    free(coroutine);
+}
+
+// Keeps a finished coroutine for the next async call, unless the pool is full or its stacks grew.
+static void release_coroutine(Coroutine *coroutine) {
+    bool is_small = coroutine->frames_end - coroutine->frames == CALLSTACK_INITIAL_SIZE &&
+                    coroutine->stack_end - coroutine->stack == STACK_INITIAL_SIZE;
+    if (vm.pooled_count == COROUTINE_POOL_SIZE || !is_small) {
+        free_coroutine(coroutine);
+        return;
+    }
+
+    coroutine->next = vm.pooled_head;
+    vm.pooled_head = coroutine;
+    vm.pooled_count++;
+}
+
+static COLD void grow_frames(Coroutine *coroutine) {
+    uint32_t depth = coroutine->frame - coroutine->frames;
+    uint32_t capacity = 2 * (coroutine->frames_end - coroutine->frames);
+    coroutine->frames = realloc(coroutine->frames, sizeof(*coroutine->frames) * capacity);
+    if (coroutine->frames == NULL) OUT_OF_MEMORY();
+    coroutine->frame = coroutine->frames + depth;
+    coroutine->frames_end = coroutine->frames + capacity;
+}
+
+// Moves the stack to a bigger allocation and rebases everything that points into it.
+static COLD void grow_stack(Coroutine *coroutine, uint32_t min_capacity) {
+    uint32_t capacity = coroutine->stack_end - coroutine->stack;
+    while (capacity < min_capacity) capacity *= 2;
+
+    Value *stack = malloc(sizeof(*stack) * capacity);
+    if (stack == NULL) OUT_OF_MEMORY();
+    Value *old_stack = coroutine->stack;
+    memcpy(stack, old_stack, sizeof(*stack) * (coroutine->stack_top - old_stack));
+
+    for (CallFrame *frame = coroutine->frames; frame <= coroutine->frame; frame++) {
+        frame->slots = stack + (frame->slots - old_stack);
+    }
+    for (ObjUpvalue *upvalue = coroutine->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - old_stack);
+    }
+    coroutine->stack_top = stack + (coroutine->stack_top - old_stack);
+
+    free(old_stack);
+    coroutine->stack = stack;
+    coroutine->stack_end = stack + capacity;
+}
+
 // Creates the first callframe in the new coroutine.
 static void init_callstack(Coroutine *coroutine, ObjClosure *closure) {
     CallFrame *frame = coroutine->frame = coroutine->frames;
@@ -134,6 +222,17 @@ static void vm_add_coroutine_before(Coroutine *coroutine) {
     vm.coroutine->prev = coroutine;
 }
 
+static bool frame_fits(const Coroutine *coroutine, const Value *slots, const ObjFunction *function) {
+    return slots + function->max_depth + STACK_HELPER_SLOTS <= coroutine->stack_end;
+}
+
+// Grows the stack to fit a frame of `function` at `slots`, and returns where its slots are after the stack moved.
+static COLD Value *grow_stack_for_frame(Coroutine *coroutine, const Value *slots, const ObjFunction *function) {
+    uint32_t offset = slots - coroutine->stack;
+    grow_stack(coroutine, offset + function->max_depth + STACK_HELPER_SLOTS);
+    return coroutine->stack + offset;
+}
+
 static bool call(ObjClosure *closure, uint8_t arg_num) {
     if (arg_num != closure->function->arity) {
         runtime_error("Function '%s' expected %d arguments but got %d", closure->function->name->cstr,
@@ -141,41 +240,90 @@ static bool call(ObjClosure *closure, uint8_t arg_num) {
         return false;
     }
 
-    if (closure->function->is_async) {
-        Coroutine *coroutine = new_coroutine();
-        init_callstack(coroutine, closure);
-        vm_add_coroutine_before(coroutine);
-
-        // Move arguments from callee's stack to the new coroutine.
-        vm.coroutine->stack_top -= arg_num + 1;
-        coroutine->stack_top = coroutine->stack + arg_num + 1;
-        memcpy(coroutine->stack, vm.coroutine->stack_top, sizeof(*coroutine->stack) * (arg_num + 1));
-
-        // Push promise to the callee's stack.
-        stack_push(VALUE_OBJECT(coroutine->promise));
-
-        vm.coroutine = coroutine;
-    } else {
-        if (vm.coroutine->frame - vm.coroutine->frames + 1 == CALLSTACK_SIZE) {
+    // Async functions run eagerly on the caller's stack too, until they suspend or return.
+    Coroutine *coroutine = vm.coroutine;
+    if (coroutine->frame + 1 == coroutine->frames_end) {
+        if (coroutine->frames_end - coroutine->frames == CALLSTACK_MAX_SIZE) {
             runtime_error("Stack overflow");
             return false;
         }
+        grow_frames(coroutine);
+    }
 
-        CallFrame *frame = ++vm.coroutine->frame;
-        frame->closure = closure;
-        frame->ip = closure->function->chunk.code;
-        frame->slots = vm.coroutine->stack_top - arg_num - 1;
+    Value *slots = coroutine->stack_top - arg_num - 1;
+    if (!frame_fits(coroutine, slots, closure->function)) {
+        slots = grow_stack_for_frame(coroutine, slots, closure->function);
     }
 
+    CallFrame *frame = ++coroutine->frame;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = slots;
+    frame->is_spawned = false;
     return true;
 }
 
+// Moves the innermost async function that runs eagerly on the current coroutine's stack, and the frames it called,
+// to a coroutine of its own, which becomes the current one. The caller gets its promise and continues once the
+// new coroutine suspends, like it would have if the function had its own coroutine from the start.
+static void materialize_eager_call(void) {
+    Coroutine *coroutine = vm.coroutine;
+    CallFrame *eager = coroutine->frame;
+    while (eager > coroutine->frames && !eager->closure->function->is_async) eager--;
+    // The first frame of a coroutine is not eager, it already has a coroutine of its own.
+    if (eager == coroutine->frames) return;
+
+    // Allocate before anything leaves the caller's stack, where the collector can still see it.
+    ObjPromise *promise = eager->is_spawned ? NULL : new_promise();
+    Coroutine *materialized = new_coroutine();
+    materialized->promise = promise;
+    uint32_t frames_count = coroutine->frame - eager + 1;
+    Value *base = eager->slots;
+    uint32_t top_slots = coroutine->frame->slots - base;
+
+    // Nothing points into the new stacks yet, apart from the first frame.
+    materialized->frame = materialized->frames;
+    materialized->frame->slots = materialized->stack;
+    while (materialized->frames_end - materialized->frames < frames_count) grow_frames(materialized);
+    uint32_t depth = top_slots + coroutine->frame->closure->function->max_depth + STACK_HELPER_SLOTS;
+    if (depth > STACK_INITIAL_SIZE) grow_stack(materialized, depth);
+
+    Value *stack = materialized->stack;
+    memcpy(stack, base, sizeof(*stack) * (coroutine->stack_top - base));
+    for (uint32_t i = 0; i < frames_count; i++) {
+        materialized->frames[i] = eager[i];
+        materialized->frames[i].slots = stack + (eager[i].slots - base);
+    }
+    materialized->frame = materialized->frames + frames_count - 1;
+    materialized->stack_top = stack + (coroutine->stack_top - base);
+
+    // Upvalues are sorted from the top of the stack, so the moved ones are at the start of the list.
+    ObjUpvalue **tail = &materialized->open_upvalues;
+    while (coroutine->open_upvalues != NULL && coroutine->open_upvalues->location >= base) {
+        ObjUpvalue *upvalue = coroutine->open_upvalues;
+        coroutine->open_upvalues = upvalue->next;
+        upvalue->location = stack + (upvalue->location - base);
+        *tail = upvalue;
+        tail = &upvalue->next;
+    }
+    *tail = NULL;
+
+    // The promise takes the place of the callee and its arguments, spawned calls leave nil for the pop after them.
+    coroutine->frame = eager - 1;
+    coroutine->stack_top = base;
+    coroutine_stack_push(coroutine, promise == NULL ? VALUE_NIL() : VALUE_OBJECT(promise));
+
+    vm_add_coroutine_before(materialized);
+    vm.coroutine = materialized;
+}
+
 static bool call_native(ObjNative *native, uint8_t arg_num) {
     if (arg_num != native->arity) {
         runtime_error("Function '%s' expected %d arguments but got %d", native->name, native->arity, arg_num);
         return false;
     }
 
+    if (native->suspends) materialize_eager_call();
     Coroutine *callee = vm.coroutine;
 
     Value return_value;
@@ -188,19 +336,46 @@ static bool call_native(ObjNative *native, uint8_t arg_num) {
     return true;
 }
 
+static bool find_method(ObjClass *class, ObjString *name, ObjClosure **method) {
+#ifdef INLINE_CACHING
+    // Class ids are sequential, spread them before mixing in the name hash.
+    uint32_t index = (class->id * 0x9e3779b1u ^ name->hash) & (METHOD_CACHE_SIZE - 1);
+    MethodCacheEntry *entry = &vm.method_cache[index];
+    // Names are interned and a class gets a new id whenever its methods change, so a match is never stale.
+    if (entry->class_id == class->id && entry->name == name) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+        vm.method_cache_stats.hits++;
+#endif
+        *method = entry->method;
+        return true;
+    }
+#ifdef DEBUG_INLINE_CACHE_STATS
+    vm.method_cache_stats.misses++;
+#endif
+#endif
+
+    Value value;
+    if (!hashmap_get(&class->methods, name, &value)) return false;
+    *method = (ObjClosure *) AS_OBJECT(value);
+#ifdef INLINE_CACHING
+    *entry = (MethodCacheEntry) {.class_id = class->id, .name = name, .method = *method};
+#endif
+    return true;
+}
+
 static bool call_value(Value value, uint8_t arg_num) {
-    if (value.type == VAL_OBJECT) {
-        switch (value.as.object->type) {
-            case OBJ_CLOSURE: return call((ObjClosure *) value.as.object, arg_num);
-            case OBJ_NATIVE:  return call_native((ObjNative *) value.as.object, arg_num);
+    if (IS_OBJECT(value)) {
+        switch (AS_OBJECT(value)->type) {
+            case OBJ_CLOSURE: return call((ObjClosure *) AS_OBJECT(value), arg_num);
+            case OBJ_NATIVE:  return call_native((ObjNative *) AS_OBJECT(value), arg_num);
             case OBJ_CLASS:   {
-                ObjClass *class = (ObjClass *) value.as.object;
+                ObjClass *class = (ObjClass *) AS_OBJECT(value);
                 Value instance = VALUE_OBJECT(new_instance(class));
                 *(vm.coroutine->stack_top - arg_num - 1) = instance;
 
-                Value init_value;
-                if (hashmap_get(&class->methods, vm.init_string, &init_value)) {
-                    return call((ObjClosure *) init_value.as.object, arg_num);
+                ObjClosure *init;
+                if (find_method(class, vm.init_string, &init)) {
+                    return call(init, arg_num);
                 } else if (arg_num != 0) {
                     runtime_error("Class '%s' has no initializer, expected 0 arguments but got %d", class->name->cstr,
                                   arg_num);
@@ -210,7 +385,7 @@ static bool call_value(Value value, uint8_t arg_num) {
                 return true;
             }
             case OBJ_BOUND_METHOD: {
-                ObjBoundMethod *bound_method = (ObjBoundMethod *) value.as.object;
+                ObjBoundMethod *bound_method = (ObjBoundMethod *) AS_OBJECT(value);
                 *(vm.coroutine->stack_top - arg_num - 1) = bound_method->instance;
                 return call(bound_method->method, arg_num);
             }
@@ -223,7 +398,7 @@ static bool call_value(Value value, uint8_t arg_num) {
 }
 
 static ObjUpvalue *capture_upvalue(Value *value) {
-    ObjUpvalue *prev = NULL, *current = vm.open_upvalues;
+    ObjUpvalue *prev = NULL, *current = vm.coroutine->open_upvalues;
     while (current != NULL && current->location > value) {
         prev = current;
         current = current->next;
@@ -234,7 +409,7 @@ static ObjUpvalue *capture_upvalue(Value *value) {
     ObjUpvalue *new = new_upvalue(value);
     new->next = current;
     if (prev == NULL) {
-        vm.open_upvalues = new;
+        vm.coroutine->open_upvalues = new;
     } else {
         prev->next = new;
     }
@@ -243,13 +418,13 @@ static ObjUpvalue *capture_upvalue(Value *value) {
 }
 
 static void close_upvalues(Value *value) {
-    ObjUpvalue *current = vm.open_upvalues;
+    ObjUpvalue *current = vm.coroutine->open_upvalues;
     while (current != NULL && current->location >= value) {
         current->closed = *current->location;
         current->location = &current->closed;
         current = current->next;
     }
-    vm.open_upvalues = current;
+    vm.coroutine->open_upvalues = current;
 }
 
 void promise_add_coroutine(ObjPromise *promise, Coroutine *coroutine) {
@@ -291,77 +466,371 @@ void fulfill_promise(ObjPromise *promise, Value value) {
     }
 }
 
-// Checks timers on all sleeping coroutines, wakes up if the timer has finished.
-// Returns the minimum time in miliseconds until the soonest one wakes up.
+void vm_add_timer(Coroutine *coroutine, uint64_t wake_time_ns) {
+    if (vm.timers_length == vm.timers_capacity) {
+        vm.timers_capacity = VEC_GROW_CAPACITY(vm.timers_capacity);
+        vm.timers = realloc(vm.timers, sizeof(*vm.timers) * vm.timers_capacity);
+        if (vm.timers == NULL) OUT_OF_MEMORY();
+    }
+
+    // Sift up from the new leaf.
+    uint32_t index = vm.timers_length++;
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (vm.timers[parent].wake_time_ns <= wake_time_ns) break;
+        vm.timers[index] = vm.timers[parent];
+        index = parent;
+    }
+    vm.timers[index] = (Timer){.wake_time_ns = wake_time_ns, .coroutine = coroutine};
+}
+
+static Coroutine *pop_timer(void) {
+    Coroutine *coroutine = vm.timers[0].coroutine;
+    Timer last = vm.timers[--vm.timers_length];
+
+    // Sift the last leaf down from the root.
+    uint32_t index = 0;
+    for (;;) {
+        uint32_t child = 2 * index + 1;
+        if (child >= vm.timers_length) break;
+        if (child + 1 < vm.timers_length && vm.timers[child + 1].wake_time_ns < vm.timers[child].wake_time_ns) child++;
+        if (last.wake_time_ns <= vm.timers[child].wake_time_ns) break;
+        vm.timers[index] = vm.timers[child];
+        index = child;
+    }
+    vm.timers[index] = last;
+    return coroutine;
+}
+
+// Wakes up sleeping coroutines whose time has come, they go ahead of the active ones in the order they were due.
+// Returns the time in nanoseconds until the next one wakes up.
 static uint64_t check_sleeping_coroutines(void) {
-    uint64_t current_ms = get_time_ms();
-    uint64_t min_wait_ms = UINT64_MAX;
-    Coroutine *current = vm.sleeping_head;
-    while (current != NULL) {
-        if (current->sleep_time_ms <= current_ms) {
-            Coroutine *removed = ll_remove(&vm.sleeping_head, &current);
-            ll_add_head(&vm.active_head, removed);
+    if (vm.timers_length == 0) return UINT64_MAX;
+
+    uint64_t current_ns = get_time_ns();
+    Coroutine *woken_head = NULL;
+    Coroutine *woken_tail = NULL;
+    while (vm.timers_length > 0 && vm.timers[0].wake_time_ns <= current_ns) {
+        Coroutine *woken = pop_timer();
+        woken->prev = woken_tail;
+        woken->next = NULL;
+        if (woken_tail == NULL) {
+            woken_head = woken;
         } else {
-            if (current->sleep_time_ms < min_wait_ms) min_wait_ms = current->sleep_time_ms;
-            current = current->next;
+            woken_tail->next = woken;
+        }
+        woken_tail = woken;
+    }
+
+    if (woken_head != NULL) {
+        woken_tail->next = vm.active_head;
+        if (vm.active_head != NULL) vm.active_head->prev = woken_tail;
+        vm.active_head = woken_head;
+    }
+
+    if (vm.timers_length == 0) return UINT64_MAX;
+    return vm.timers[0].wake_time_ns - current_ns;
+}
+
+static IoState *io_state(int fd) {
+    if ((uint32_t) fd >= vm.io_states_capacity) {
+        uint32_t capacity = VEC_GROW_CAPACITY(vm.io_states_capacity);
+        while (capacity <= (uint32_t) fd) capacity *= 2;
+        vm.io_states = realloc(vm.io_states, sizeof(*vm.io_states) * capacity);
+        if (vm.io_states == NULL) OUT_OF_MEMORY();
+        memset(vm.io_states + vm.io_states_capacity, 0, sizeof(*vm.io_states) * (capacity - vm.io_states_capacity));
+        vm.io_states_capacity = capacity;
+    }
+    return &vm.io_states[fd];
+}
+
+static bool is_write_io(IoOperation operation) {
+    return operation == IO_SEND || operation == IO_SENDFILE;
+}
+
+static IoWaiter **io_queue_head(IoState *state, IoOperation operation) {
+    return is_write_io(operation) ? &state->writers_head : &state->readers_head;
+}
+
+static bool *io_readiness(IoState *state, IoOperation operation) {
+    return is_write_io(operation) ? &state->is_writable : &state->is_readable;
+}
+
+static IoWaiter *enqueue_io(IoState *state, const IoWaiter *operation) {
+    IoWaiter *waiter = malloc(sizeof(*waiter));
+    if (waiter == NULL) OUT_OF_MEMORY();
+    *waiter = *operation;
+    waiter->next = NULL;
+
+    IoWaiter **head = io_queue_head(state, operation->operation);
+    IoWaiter **tail = is_write_io(operation->operation) ? &state->writers_tail : &state->readers_tail;
+    if (*head == NULL) {
+        *head = waiter;
+    } else {
+        (*tail)->next = waiter;
+    }
+    *tail = waiter;
+
+    vm.io_waiting_count++;
+    return waiter;
+}
+
+static void free_io_waiter(IoWaiter *waiter) {
+    vm.io_waiting_count--;
+    free(waiter);
+}
+
+// Lets go of what the operation held on to while it wasn't done.
+static void release_io_resources(IoWaiter *waiter) {
+    object_enable_gc((Object *) waiter->promise);
+    if (waiter->buffer != NULL) object_enable_gc(waiter->buffer);
+    if (waiter->operation == IO_SENDFILE) close(waiter->file_fd);
+}
+
+// Hands the result of the operation's syscall to its callback, and fulfills the promise once it's done.
+static IoStatus complete_io(IoWaiter *waiter, ssize_t result) {
+    // Set current coroutine to the one that started the operation for the callback.
+    Coroutine *current = vm.coroutine;
+    vm.coroutine = waiter->creator;
+    Value value = VALUE_NIL();
+    IoStatus status = waiter->callback(waiter, result, &value);
+    vm.coroutine = current;
+
+    if (status == IO_DONE) fulfill_promise(waiter->promise, value);
+    if (status != IO_AGAIN) release_io_resources(waiter);
+    return status;
+}
+
+// Operations whose descriptor was closed give nil, like reads on a closed connection.
+static void abandon_io(IoWaiter *waiter) {
+    fulfill_promise(waiter->promise, VALUE_NIL());
+    release_io_resources(waiter);
+    free_io_waiter(waiter);
+}
+
+static ssize_t perform_io(IoWaiter *waiter) {
+    ssize_t result;
+    switch (waiter->operation) {
+        case IO_ACCEPT: result = accept(waiter->fd, NULL, NULL); break;
+        case IO_RECV:   result = recv(waiter->fd, waiter->data, waiter->length, 0); break;
+        case IO_SEND:   result = send(waiter->fd, waiter->data, waiter->length, 0); break;
+        case IO_SENDFILE: {
+            // The callback moves the offset, like it moves `data` after a partial send.
+            off_t offset = waiter->offset;
+            result = sendfile(waiter->fd, waiter->file_fd, &offset, waiter->length);
+            break;
+        }
+        default: UNREACHABLE();
+    }
+    return result == -1 ? -errno : result;
+}
+
+// Runs the operation right away until it's done or fails, returns IO_AGAIN when it would block.
+static IoStatus try_io(IoWaiter *waiter) {
+    for (;;) {
+        ssize_t result = perform_io(waiter);
+        if (result == -EAGAIN || result == -EWOULDBLOCK) return IO_AGAIN;
+        IoStatus status = complete_io(waiter, result);
+        if (status != IO_AGAIN) return status;
+    }
+}
+
+#ifdef IO_URING
+static void submit_io(IoWaiter *waiter, bool wait_ready) {
+    // There is no sendfile in io_uring, it runs once a poll reports the socket is writable.
+    bool is_sendfile = waiter->operation == IO_SENDFILE;
+    if (wait_ready || is_sendfile) {
+        // Older kernels hand EAGAIN back for non-blocking sockets instead of waiting, so wait with a poll first.
+        struct io_uring_sqe *poll = uring_get_sqe(&vm.uring);
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = waiter->fd;
+        poll->poll32_events = is_write_io(waiter->operation) ? POLLOUT : POLLIN;
+        if (is_sendfile) {
+            poll->user_data = (uintptr_t) waiter;
+            return;
         }
+        poll->flags = IOSQE_IO_LINK;
     }
-    if (min_wait_ms == UINT64_MAX) return UINT64_MAX;
-    return min_wait_ms - current_ms;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&vm.uring);
+    switch (waiter->operation) {
+        case IO_ACCEPT: sqe->opcode = IORING_OP_ACCEPT; break;
+        case IO_RECV:   sqe->opcode = IORING_OP_RECV; break;
+        case IO_SEND:   sqe->opcode = IORING_OP_SEND; break;
+        default:        UNREACHABLE();
+    }
+    sqe->fd = waiter->fd;
+    sqe->addr = (uintptr_t) waiter->data;
+    sqe->len = waiter->length;
+    sqe->user_data = (uintptr_t) waiter;
 }
 
-void *vm_epoll_add(int fd, uint32_t epoll_events, EpollCallbackFn callback, size_t callback_data_size) {
-    EpollData *epoll_data = malloc(sizeof(*epoll_data) + callback_data_size);
-    if (epoll_data == NULL) OUT_OF_MEMORY();
-    epoll_data->fd = fd;
-    epoll_data->close_fd = false;
-    epoll_data->creator = vm.coroutine;
-    epoll_data->callback = callback;
+// Submits pending operations, waits up to `timeout_ns` for completions and finishes the completed operations.
+static bool check_uring_completions(uint64_t timeout_ns) {
+    uring_enter(&vm.uring, timeout_ns);
+
+    for (struct io_uring_cqe *cqe; (cqe = uring_peek_cqe(&vm.uring)) != NULL;) {
+        IoWaiter *waiter = (IoWaiter *) (uintptr_t) cqe->user_data;
+        ssize_t result = cqe->res;
+        uring_cqe_seen(&vm.uring);
+
+        // Polls linked before operations and cancellations have nothing to finish.
+        if (waiter == NULL) continue;
+        if (waiter->fd == -1) {
+            // Cancelled, or finished before the cancellation got to it.
+            if (waiter->operation == IO_ACCEPT && result >= 0) close((int) result);
+            abandon_io(waiter);
+            continue;
+        }
+        IoStatus status;
+        if (waiter->operation == IO_SENDFILE) {
+            status = result < 0 ? complete_io(waiter, result) : try_io(waiter);
+        } else if (result == -EAGAIN) {
+            submit_io(waiter, true);
+            continue;
+        } else {
+            status = complete_io(waiter, result);
+        }
+        if (status == IO_AGAIN) {
+            submit_io(waiter, false);
+            continue;
+        }
 
-    struct epoll_event event = {.events = epoll_events, .data.ptr = epoll_data};
+        // The next operation in the same direction only starts now, so their data doesn't interleave.
+        IoWaiter **head = io_queue_head(&vm.io_states[waiter->fd], waiter->operation);
+        *head = waiter->next;
+        if (*head != NULL) submit_io(*head, false);
+        free_io_waiter(waiter);
+        if (status == IO_ERROR) return false;
+    }
 
-    bool retried = false;
-retry:
-    if (epoll_ctl(vm.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
-        if (retried || errno != EEXIST) PANIC("Error in epoll_ctl: %s", strerror(errno));
+    return true;
+}
+#endif
+
+// Starts an IO operation on behalf of the current coroutine. Finishes right away when possible, otherwise a copy of
+// the operation waits for its descriptor and the promise is fulfilled later. Returns false on a runtime error.
+bool vm_io_start(const IoWaiter *operation) {
+    IoWaiter waiter = *operation;
+    waiter.creator = vm.coroutine;
+    object_disable_gc((Object *) waiter.promise);
+    if (waiter.buffer != NULL) object_disable_gc(waiter.buffer);
+
+    IoState *state = io_state(waiter.fd);
+    IoWaiter **head = io_queue_head(state, waiter.operation);
+#ifdef IO_URING
+    if (vm.has_uring) {
+        // Submitted with the next batch, unless it has to wait for the operations started before it.
+        bool is_first = *head == NULL;
+        if (is_first && waiter.operation == IO_SENDFILE) {
+            // Usually the socket is writable already, which saves waiting for the poll.
+            IoStatus status = try_io(&waiter);
+            if (status != IO_AGAIN) return status == IO_DONE;
+        }
+        IoWaiter *queued = enqueue_io(state, &waiter);
+        if (is_first) submit_io(queued, false);
+        return true;
+    }
+#endif
 
-        // Duplicate file descriptor, mark it for closure on epoll_delete, and retry.
-        fd = dup(fd);
-        epoll_data->fd = fd;
-        epoll_data->close_fd = true;
-        retried = true;
-        goto retry;
+    // Readiness is only tracked once epoll reports it, and operations that are already waiting go first.
+    if (*head == NULL && (!state->is_registered || *io_readiness(state, waiter.operation))) {
+        IoStatus status = try_io(&waiter);
+        if (status != IO_AGAIN) return status == IO_DONE;
+        *io_readiness(state, waiter.operation) = false;
     }
+    enqueue_io(state, &waiter);
+
+    if (!state->is_registered) {
+        // Edge-triggered, so the registration stays for both directions until the descriptor is closed. Readiness
+        // at the time of registration is reported as an edge too.
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = waiter.fd};
+        if (epoll_ctl(vm.epoll_fd, EPOLL_CTL_ADD, waiter.fd, &event) != 0) {
+            PANIC("Error in epoll_ctl: %s", strerror(errno));
+        }
+        state->is_registered = true;
+        vm.io_registered_count++;
+    }
+    return true;
+}
 
-    vm.epoll_count++;
-    return epoll_data->data;
+// Forgets the descriptor before it's closed, closing it also removes it from epoll. Operations still waiting on it
+// give nil.
+void vm_io_close(int fd) {
+    if ((uint32_t) fd >= vm.io_states_capacity) return;
+    IoState *state = &vm.io_states[fd];
+    IoWaiter *waiters[] = {state->readers_head, state->writers_head};
+    if (state->is_registered) vm.io_registered_count--;
+    *state = (IoState){0};
+
+    for (uint32_t i = 0; i < sizeof(waiters) / sizeof(*waiters); i++) {
+        IoWaiter *waiter = waiters[i];
+#ifdef IO_URING
+        // The kernel still owns the first operation, it's abandoned once its cancellation completes.
+        if (vm.has_uring && waiter != NULL) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&vm.uring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uintptr_t) waiter;
+            waiter->fd = -1;
+            waiter = waiter->next;
+        }
+#endif
+        while (waiter != NULL) {
+            IoWaiter *next = waiter->next;
+            abandon_io(waiter);
+            waiter = next;
+        }
+    }
 }
 
-void vm_epoll_delete(EpollData *epoll_data) {
-    if (epoll_ctl(vm.epoll_fd, EPOLL_CTL_DEL, epoll_data->fd, NULL) != 0) {
-        PANIC("Error in epoll_ctl: %s", strerror(errno));
+// Runs the operations waiting on a ready descriptor in one direction, in order, until one would block again.
+static bool run_io_queue(IoState *state, IoOperation direction) {
+    IoWaiter **head = io_queue_head(state, direction);
+    bool *is_ready = io_readiness(state, direction);
+    while (*head != NULL && *is_ready) {
+        IoWaiter *waiter = *head;
+        IoStatus status = try_io(waiter);
+        if (status == IO_AGAIN) {
+            *is_ready = false;
+            return true;
+        }
+
+        *head = waiter->next;
+        free_io_waiter(waiter);
+        if (status == IO_ERROR) return false;
     }
-    vm.epoll_count--;
-    if (epoll_data->close_fd) close(epoll_data->fd);
-    free(epoll_data);
+    return true;
 }
 
-// Checks epoll for events and executes callbacks that may wake up coroutines.
-static bool check_polling_coroutines(uint64_t ms) {
-    const int max_events = 16;
-    struct epoll_event events[max_events];
+// Checks for IO events, waiting up to `timeout_ns` (UINT64_MAX is forever), and runs the operations that can make
+// progress, which may wake up coroutines.
+static bool check_polling_coroutines(uint64_t timeout_ns) {
+#ifdef IO_URING
+    if (vm.has_uring) return check_uring_completions(timeout_ns);
+#endif
 
-    int events_num = epoll_wait(vm.epoll_fd, events, max_events, ms);
+    // Epoll counts in milliseconds, round up so the sleeping coroutine is due once it returns instead of spinning.
+    int timeout_ms = -1;
+    if (timeout_ns != UINT64_MAX) {
+        uint64_t ms = (timeout_ns + 999999) / 1000000;
+        timeout_ms = ms > INT_MAX ? INT_MAX : (int) ms;
+    }
+
+    // No more events can be ready than there are registered file descriptors.
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int max_events = vm.io_registered_count < EPOLL_MAX_EVENTS ? vm.io_registered_count : EPOLL_MAX_EVENTS;
+
+    int events_num = epoll_wait(vm.epoll_fd, events, max_events, timeout_ms);
     if (events_num == -1) PANIC("Error in epoll_wait: %s", strerror(errno));
 
     for (int i = 0; i < events_num; i++) {
-        EpollData *epoll_data = events[i].data.ptr;
+        uint32_t flags = events[i].events;
+        IoState *state = &vm.io_states[events[i].data.fd];
+        // Errors and hang ups are reported to the operations themselves when they run.
+        if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) state->is_readable = true;
+        if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) state->is_writable = true;
 
-        // Set current coroutine to the one that created the event for the callback.
-        Coroutine *current = vm.coroutine;
-        vm.coroutine = epoll_data->creator;
-        if (!epoll_data->callback(epoll_data)) return false;
-        vm.coroutine = current;
+        if (!run_io_queue(state, IO_RECV) || !run_io_queue(state, IO_SEND)) return false;
     }
 
     return true;
@@ -372,527 +841,1042 @@ InterpretResult schedule_coroutine(void) {
 
     for (;;) {
         // Check sleeping coroutines and keep timer until the soonest coroutine.
-        uint64_t min_wait_ms = check_sleeping_coroutines();
-
-        // Check IO events without blocking.
-        if (!check_polling_coroutines(0)) return RESULT_RUNTIME_ERROR;
+        uint64_t min_wait_ns = check_sleeping_coroutines();
 
         // There are currently active coroutines.
         if (vm.active_head != NULL) {
+            // Check IO events without blocking, though only every few rounds so yielding coroutines don't pay for
+            // a syscall each.
+            if (vm.io_waiting_count > 0 && ++vm.rounds_since_poll >= POLL_INTERVAL) {
+                vm.rounds_since_poll = 0;
+                if (!check_polling_coroutines(0)) return RESULT_RUNTIME_ERROR;
+            }
+
             // Start again from the head.
             vm.coroutine = vm.active_head;
             return RESULT_NONE;
         }
 
         // There are no sleeping and no polling coroutines, finish execution.
-        if (min_wait_ms == UINT64_MAX && vm.epoll_count == 0) return RESULT_OK;
+        if (min_wait_ns == UINT64_MAX && vm.io_waiting_count == 0) return RESULT_OK;
+
+        // Only sleeping coroutines, wait for the soonest one without rounding to milliseconds.
+        if (vm.io_waiting_count == 0) {
+            struct timespec wait = {.tv_sec = min_wait_ns / 1000000000, .tv_nsec = min_wait_ns % 1000000000};
+            if (nanosleep(&wait, NULL) != 0 && errno != EINTR) PANIC("Error in nanosleep: %s", strerror(errno));
+            continue;
+        }
 
         // Block until sleeping coroutine wakes up, or IO event happens.
-        if (!check_polling_coroutines(min_wait_ms)) return RESULT_RUNTIME_ERROR;
+        vm.rounds_since_poll = 0;
+        if (!check_polling_coroutines(min_wait_ns)) return RESULT_RUNTIME_ERROR;
     }
 }
 
 static InterpretResult run(void) {
-#define READ_U8() (*vm.coroutine->frame->ip++)
-#define READ_U16() \
-    (vm.coroutine->frame->ip += 2, (uint16_t) (*(vm.coroutine->frame->ip - 2) | (*(vm.coroutine->frame->ip - 1) << 8)))
-#define READ_CONST() (vm.coroutine->frame->closure->function->chunk.constants.values[READ_U8()])
-#define READ_STRING() ((ObjString *) READ_CONST().as.object)
+    // The active frame, its ip and slots, and the stack top live in locals while executing. They are written back
+    // to the coroutine with `SAVE_STATE()` before anything that may read them (calls, allocations that may trigger
+    // GC, errors, switching coroutines) and reloaded with `LOAD_STATE()` whenever the current coroutine or frame
+    // may have changed.
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *stack_top;
+
+#define SAVE_STATE()                         \
+    do {                                     \
+        frame->ip = ip;                      \
+        vm.coroutine->stack_top = stack_top; \
+    } while (0)
+#define LOAD_STATE()                         \
+    do {                                     \
+        frame = vm.coroutine->frame;         \
+        ip = frame->ip;                      \
+        slots = frame->slots;                \
+        stack_top = vm.coroutine->stack_top; \
+    } while (0)
 
-#define UNARY_OP(op)                                                                                     \
-    do {                                                                                                 \
-        if (stack_peek(0).type != VAL_NUMBER) {                                                          \
-            runtime_error("Operand must be a number but found '%s'", value_to_temp_cstr(stack_peek(0))); \
-            return RESULT_RUNTIME_ERROR;                                                                 \
-        }                                                                                                \
-        (vm.coroutine->stack_top - 1)->as.number op;                                                     \
-        break;                                                                                           \
+#define READ_U8() (*ip++)
+#define READ_U16() (ip += 2, (uint16_t) (*(ip - 2) | (*(ip - 1) << 8)))
+#define READ_CONST() (frame->closure->function->chunk.constants.values[READ_U8()])
+#define READ_STRING() ((ObjString *) AS_OBJECT(READ_CONST()))
+
+#define PUSH(value)           \
+    do {                      \
+        *stack_top = (value); \
+        stack_top++;          \
     } while (0)
-#define BINARY_OP(value_type, op)                                                                        \
+#define POP() (*--stack_top)
+#define POPN(n) (stack_top -= (n))
+#define PEEK(distance) (stack_top[-1 - (distance)])
+
+#define RUNTIME_ERROR(...)           \
+    do {                             \
+        SAVE_STATE();                \
+        runtime_error(__VA_ARGS__);  \
+        return RESULT_RUNTIME_ERROR; \
+    } while (0)
+
+// Quickening: replaces the opcode of the current instruction, which must not have operands, and steps back so
+// that the next dispatch executes the new one.
+#define REWRITE_OPCODE(opcode) (*--ip = (opcode))
+
+// Adds the two strings on top of the stack, they stay there while concatenating so GC can see them.
+#define ADD_STRINGS()                                          \
+    do {                                                       \
+        const ObjString *b = (ObjString *) AS_OBJECT(PEEK(0)); \
+        const ObjString *a = (ObjString *) AS_OBJECT(PEEK(1)); \
+        SAVE_STATE();                                          \
+        ObjString *result = concat_strings(a, b);              \
+        POPN(2);                                               \
+        PUSH(VALUE_OBJECT(result));                            \
+    } while (0)
+#define ADD_TYPE_ERROR()                                                                                     \
+    do {                                                                                                     \
+        Value value = (is_object_type(PEEK(0), OBJ_STRING) || IS_NUMBER(PEEK(0))) ? PEEK(1) : PEEK(0);       \
+        RUNTIME_ERROR("Operands must both be numbers or strings but found '%s'", value_to_temp_cstr(value)); \
+    } while (0)
+
+#define UNARY_OP(op)                                                                               \
+    do {                                                                                           \
+        if (!IS_NUMBER(PEEK(0))) {                                                                 \
+            RUNTIME_ERROR("Operand must be a number but found '%s'", value_to_temp_cstr(PEEK(0))); \
+        }                                                                                          \
+        double number = AS_NUMBER(PEEK(0));                                                        \
+        number op;                                                                                 \
+        PEEK(0) = VALUE_NUMBER(number);                                                            \
+    } while (0)
+#define BINARY_OP(value_type, op)                                                                  \
+    do {                                                                                           \
+        if (!IS_NUMBER(PEEK(0))) {                                                                 \
+            RUNTIME_ERROR("Operands must be numbers but found '%s'", value_to_temp_cstr(PEEK(0))); \
+        }                                                                                          \
+        if (!IS_NUMBER(PEEK(1))) {                                                                 \
+            RUNTIME_ERROR("Operands must be numbers but found '%s'", value_to_temp_cstr(PEEK(1))); \
+        }                                                                                          \
+        double b = AS_NUMBER(POP());                                                               \
+        double a = AS_NUMBER(POP());                                                               \
+        PUSH(value_type(a op b));                                                                  \
+    } while (0)
+#define COMPARE_JUMP(op, jump_if)                                                                  \
+    do {                                                                                           \
+        if (!IS_NUMBER(PEEK(0))) {                                                                 \
+            RUNTIME_ERROR("Operands must be numbers but found '%s'", value_to_temp_cstr(PEEK(0))); \
+        }                                                                                          \
+        if (!IS_NUMBER(PEEK(1))) {                                                                 \
+            RUNTIME_ERROR("Operands must be numbers but found '%s'", value_to_temp_cstr(PEEK(1))); \
+        }                                                                                          \
+        double b = AS_NUMBER(POP());                                                               \
+        double a = AS_NUMBER(POP());                                                               \
+        uint16_t offset = READ_U16();                                                              \
+        if ((a op b) == (jump_if)) ip += offset;                                                   \
+    } while (0)
+#define EQUAL_JUMP(jump_if)                                                                            \
+    do {                                                                                               \
+        Value b = POP();                                                                               \
+        Value a = POP();                                                                               \
+        bool equal = IS_NUMBER(a) && IS_NUMBER(b) ? AS_NUMBER(a) == AS_NUMBER(b) : value_equals(a, b); \
+        uint16_t offset = READ_U16();                                                                  \
+        if (equal == (jump_if)) ip += offset;                                                          \
+    } while (0)
+#define CHECK_INDEX(value)                                                                               \
     do {                                                                                                 \
-        if (stack_peek(0).type != VAL_NUMBER) {                                                          \
-            runtime_error("Operands must be numbers but found '%s'", value_to_temp_cstr(stack_peek(0))); \
-            return RESULT_RUNTIME_ERROR;                                                                 \
+        if (!check_int_arg(value, 0, UINT32_MAX)) {                                                      \
+            RUNTIME_ERROR("Index must be a positive integer but found '%s'", value_to_temp_cstr(value)); \
         }                                                                                                \
-        if (stack_peek(1).type != VAL_NUMBER) {                                                          \
-            runtime_error("Operands must be numbers but found '%s'", value_to_temp_cstr(stack_peek(1))); \
-            return RESULT_RUNTIME_ERROR;                                                                 \
-        }                                                                                                \
-        double b = stack_pop().as.number;                                                                \
-        double a = stack_pop().as.number;                                                                \
-        stack_push(value_type(a op b));                                                                  \
     } while (0)
-#define ARRAY_UNARY_OP(op)                                                                                       \
-    do {                                                                                                         \
-        if (!check_int_arg(stack_peek(0), 0, UINT32_MAX)) {                                                      \
-            runtime_error("Index must be a positive integer but found '%s'", value_to_temp_cstr(stack_peek(0))); \
-            return RESULT_RUNTIME_ERROR;                                                                         \
-        }                                                                                                        \
-        uint32_t index = (uint32_t) stack_pop().as.number;                                                       \
-        Value array_value = stack_pop();                                                                         \
-        if (!is_object_type(array_value, OBJ_ARRAY)) {                                                           \
-            runtime_error("Expected an array but found '%s'", value_to_temp_cstr(array_value));                  \
-            return RESULT_RUNTIME_ERROR;                                                                         \
-        }                                                                                                        \
-        ObjArray *array = (ObjArray *) array_value.as.object;                                                    \
-        if (index >= array->length) {                                                                            \
-            runtime_error("Index out of bounds");                                                                \
-            return RESULT_RUNTIME_ERROR;                                                                         \
-        }                                                                                                        \
-        Value element = array->elements[index];                                                                  \
-        if (element.type != VAL_NUMBER) {                                                                        \
-            runtime_error("Operand must be a number but found '%s'", value_to_temp_cstr(element));               \
-            return RESULT_RUNTIME_ERROR;                                                                         \
-        }                                                                                                        \
-        array->elements[index].as.number op;                                                                     \
-        stack_push(element);                                                                                     \
+// Counters only have to be clamped, anything past UINT32_MAX is out of bounds anyway.
+#define COUNTER_INDEX(value) (AS_NUMBER(value) < UINT32_MAX ? (uint32_t) AS_NUMBER(value) : UINT32_MAX)
+#define ARRAY_GET(index_expr)                                                                         \
+    do {                                                                                              \
+        uint32_t index = (index_expr);                                                                \
+        Value value = PEEK(1);                                                                        \
+        if (is_object_type(value, OBJ_ARRAY)) {                                                       \
+            ObjArray *array = (ObjArray *) AS_OBJECT(value);                                          \
+            if (index >= array->length) RUNTIME_ERROR("Index out of bounds");                         \
+                                                                                                      \
+            POPN(1);                                                                                  \
+            PEEK(0) = array->elements[index];                                                         \
+        } else if (is_object_type(value, OBJ_STRING)) {                                               \
+            ObjString *string = (ObjString *) AS_OBJECT(value);                                       \
+            if (index >= string->length) RUNTIME_ERROR("Index out of bounds");                        \
+                                                                                                      \
+            /* The string stays on the stack while the character is copied. */                        \
+            SAVE_STATE();                                                                             \
+            ObjString *character = copy_string(&string->cstr[index], 1);                              \
+            POPN(1);                                                                                  \
+            PEEK(0) = VALUE_OBJECT(character);                                                        \
+        } else {                                                                                      \
+            RUNTIME_ERROR("Expected an array or a string but found '%s'", value_to_temp_cstr(value)); \
+        }                                                                                             \
+    } while (0)
+#define ARRAY_SET(index_expr)                                                                   \
+    do {                                                                                        \
+        uint32_t index = (index_expr);                                                          \
+        Value value = POP();                                                                    \
+        POPN(1);                                                                                \
+        Value array_value = POP();                                                              \
+        if (!is_object_type(array_value, OBJ_ARRAY)) {                                          \
+            RUNTIME_ERROR("Expected an array but found '%s'", value_to_temp_cstr(array_value)); \
+        }                                                                                       \
+        ObjArray *array = (ObjArray *) AS_OBJECT(array_value);                                  \
+                                                                                                \
+        if (index >= array->length) RUNTIME_ERROR("Index out of bounds");                       \
+        array->elements[index] = value;                                                         \
+        PUSH(value);                                                                            \
+    } while (0)
+#define ARRAY_UNARY_OP(op)                                                                                 \
+    do {                                                                                                   \
+        if (!check_int_arg(PEEK(0), 0, UINT32_MAX)) {                                                      \
+            RUNTIME_ERROR("Index must be a positive integer but found '%s'", value_to_temp_cstr(PEEK(0))); \
+        }                                                                                                  \
+        uint32_t index = (uint32_t) AS_NUMBER(POP());                                                      \
+        Value array_value = POP();                                                                         \
+        if (!is_object_type(array_value, OBJ_ARRAY)) {                                                     \
+            RUNTIME_ERROR("Expected an array but found '%s'", value_to_temp_cstr(array_value));            \
+        }                                                                                                  \
+        ObjArray *array = (ObjArray *) AS_OBJECT(array_value);                                             \
+        if (index >= array->length) RUNTIME_ERROR("Index out of bounds");                                  \
+        Value element = array->elements[index];                                                            \
+        if (!IS_NUMBER(element)) {                                                                         \
+            RUNTIME_ERROR("Operand must be a number but found '%s'", value_to_temp_cstr(element));         \
+        }                                                                                                  \
+        double number = AS_NUMBER(element);                                                                \
+        number op;                                                                                         \
+        array->elements[index] = VALUE_NUMBER(number);                                                     \
+        PUSH(element);                                                                                     \
     } while (0)
 
+// Must be followed by `LOAD_STATE()`, since the current coroutine may have been switched.
 #define SCHEDULE_COROUTINE()                           \
     if (vm.coroutine == NULL) {                        \
         InterpretResult result = schedule_coroutine(); \
         if (result != RESULT_NONE) return result;      \
     }
 
-    for (;;) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+#define INVOKE_CACHE_STAT(counter) (vm.invoke_cache_stats.counter++)
+#else
+#define INVOKE_CACHE_STAT(counter) ((void) 0)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-        print_stack();
-        const Chunk *chunk = &vm.coroutine->frame->closure->function->chunk;
-        disassemble_instr(chunk, vm.coroutine->frame->ip - chunk->code);
+#define TRACE_EXECUTION()                                      \
+    do {                                                       \
+        SAVE_STATE();                                          \
+        print_stack();                                         \
+        const Chunk *chunk = &frame->closure->function->chunk; \
+        disassemble_instr(chunk, ip - chunk->code);            \
+    } while (0)
+#else
+#define TRACE_EXECUTION() ((void) 0)
 #endif
 
+    LOAD_STATE();
+
+// Every handler must end with `DISPATCH()` rather than `break`.
+#ifdef COMPUTED_GOTO
+    // Each handler jumps straight to the next one, so the indirect branches are spread
+    // across handlers instead of sharing the single one of the switch.
+    __extension__ static void *dispatch_table[] = {
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_TRUE] = &&TARGET_OP_TRUE,
+        [OP_FALSE] = &&TARGET_OP_FALSE,
+        [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+        [OP_DUP] = &&TARGET_OP_DUP,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_POPN] = &&TARGET_OP_POPN,
+        [OP_EQUAL] = &&TARGET_OP_EQUAL,
+        [OP_GREATER] = &&TARGET_OP_GREATER,
+        [OP_LESS] = &&TARGET_OP_LESS,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_INCR] = &&TARGET_OP_INCR,
+        [OP_DECR] = &&TARGET_OP_DECR,
+        [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+        [OP_PRINT] = &&TARGET_OP_PRINT,
+        [OP_CONCAT] = &&TARGET_OP_CONCAT,
+        [OP_JUMP] = &&TARGET_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_TRUE] = &&TARGET_OP_JUMP_IF_TRUE,
+        [OP_LOOP] = &&TARGET_OP_LOOP,
+        [OP_CALL] = &&TARGET_OP_CALL,
+        [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+        [OP_SPAWN] = &&TARGET_OP_SPAWN,
+        [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_CLASS] = &&TARGET_OP_CLASS,
+        [OP_METHOD] = &&TARGET_OP_METHOD,
+        [OP_INHERIT] = &&TARGET_OP_INHERIT,
+        [OP_GET_FIELD] = &&TARGET_OP_GET_FIELD,
+        [OP_SET_FIELD] = &&TARGET_OP_SET_FIELD,
+        [OP_INVOKE] = &&TARGET_OP_INVOKE,
+        [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+        [OP_YIELD] = &&TARGET_OP_YIELD,
+        [OP_AWAIT] = &&TARGET_OP_AWAIT,
+        [OP_ARRAY] = &&TARGET_OP_ARRAY,
+        [OP_ARRAY_GET] = &&TARGET_OP_ARRAY_GET,
+        [OP_ARRAY_SET] = &&TARGET_OP_ARRAY_SET,
+        [OP_ARRAY_INCR] = &&TARGET_OP_ARRAY_INCR,
+        [OP_ARRAY_DECR] = &&TARGET_OP_ARRAY_DECR,
+        [OP_GET_LOCAL2] = &&TARGET_OP_GET_LOCAL2,
+        [OP_ADD_LOCAL_CONSTANT] = &&TARGET_OP_ADD_LOCAL_CONSTANT,
+        [OP_GET_LOCAL_FIELD] = &&TARGET_OP_GET_LOCAL_FIELD,
+        [OP_JUMP_IF_NOT_LESS] = &&TARGET_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&TARGET_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_EQUAL] = &&TARGET_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_LESS] = &&TARGET_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_GREATER] = &&TARGET_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_EQUAL] = &&TARGET_OP_JUMP_IF_EQUAL,
+        [OP_FOR_LOOP] = &&TARGET_OP_FOR_LOOP,
+        [OP_ARRAY_GET_COUNTER] = &&TARGET_OP_ARRAY_GET_COUNTER,
+        [OP_ARRAY_SET_COUNTER] = &&TARGET_OP_ARRAY_SET_COUNTER,
+        [OP_EQUAL_NUM] = &&TARGET_OP_EQUAL_NUM,
+        [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+        [OP_ADD_STRING] = &&TARGET_OP_ADD_STRING,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(*dispatch_table) == OP_COUNT, "Dispatch table is incomplete");
+
+#define CASE(opcode) TARGET_##opcode
+#define DISPATCH()                                           \
+    do {                                                     \
+        TRACE_EXECUTION();                                   \
+        __extension__({ goto *dispatch_table[READ_U8()]; }); \
+    } while (0)
+// Runs the rest of a superinstruction as `opcode`, whose operands follow. Jumping to a shared label instead makes
+// GCC spill `ip` in every handler.
+#define CONTINUE_AS(opcode) __extension__({ goto *dispatch_table[opcode]; })
+
+    DISPATCH();
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
+#define CONTINUE_AS(opcode)  \
+    instruction = (opcode);  \
+    goto execute_instruction
+#endif
+
+    for (;;) {
+        TRACE_EXECUTION();
+
         uint8_t instruction = READ_U8();
+#ifndef COMPUTED_GOTO
+    execute_instruction:
+#endif
         switch (instruction) {
-            case OP_NIL:      stack_push(VALUE_NIL()); break;
-            case OP_TRUE:     stack_push(VALUE_BOOL(true)); break;
-            case OP_FALSE:    stack_push(VALUE_BOOL(false)); break;
-            case OP_CONSTANT: stack_push(READ_CONST()); break;
-            case OP_DUP:      stack_push(stack_peek(0)); break;
-            case OP_POP:      stack_pop(); break;
-            case OP_POPN:     stack_popn(READ_U8()); break;
-            case OP_EQUAL:    stack_push(VALUE_BOOL(value_equals(stack_pop(), stack_pop()))); break;
-            case OP_GREATER:  BINARY_OP(VALUE_BOOL, >); break;
-            case OP_LESS:     BINARY_OP(VALUE_BOOL, <); break;
-            case OP_ADD:
-                if (is_object_type(stack_peek(0), OBJ_STRING) && is_object_type(stack_peek(1), OBJ_STRING)) {
-                    const ObjString *b = (ObjString *) stack_pop().as.object;
-                    const ObjString *a = (ObjString *) stack_pop().as.object;
-                    stack_push(VALUE_OBJECT(concat_strings(a, b)));
-                } else if (stack_peek(0).type == VAL_NUMBER && stack_peek(1).type == VAL_NUMBER) {
-                    stack_push(VALUE_NUMBER(stack_pop().as.number + stack_pop().as.number));
+            CASE(OP_NIL): PUSH(VALUE_NIL()); DISPATCH();
+            CASE(OP_TRUE): PUSH(VALUE_BOOL(true)); DISPATCH();
+            CASE(OP_FALSE): PUSH(VALUE_BOOL(false)); DISPATCH();
+            CASE(OP_CONSTANT): PUSH(READ_CONST()); DISPATCH();
+            CASE(OP_DUP): PUSH(PEEK(0)); DISPATCH();
+            CASE(OP_POP): POPN(1); DISPATCH();
+            CASE(OP_POPN): POPN(READ_U8()); DISPATCH();
+            CASE(OP_EQUAL): {
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    REWRITE_OPCODE(OP_EQUAL_NUM);
+                    DISPATCH();
+                }
+                Value b = POP();
+                PEEK(0) = VALUE_BOOL(value_equals(PEEK(0), b));
+                DISPATCH();
+            }
+            CASE(OP_EQUAL_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    REWRITE_OPCODE(OP_EQUAL);
+                    DISPATCH();
+                }
+                double b = AS_NUMBER(POP());
+                PEEK(0) = VALUE_BOOL(AS_NUMBER(PEEK(0)) == b);
+                DISPATCH();
+            }
+            CASE(OP_GREATER): BINARY_OP(VALUE_BOOL, >); DISPATCH();
+            CASE(OP_LESS): BINARY_OP(VALUE_BOOL, <); DISPATCH();
+            CASE(OP_ADD): {
+                // Only picks the variant for the operand types, which then does the work.
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    REWRITE_OPCODE(OP_ADD_NUM);
+                } else if (is_object_type(PEEK(0), OBJ_STRING) && is_object_type(PEEK(1), OBJ_STRING)) {
+                    REWRITE_OPCODE(OP_ADD_STRING);
                 } else {
-                    Value value = (is_object_type(stack_peek(0), OBJ_STRING) || stack_peek(0).type == VAL_NUMBER)
-                                      ? stack_peek(1)
-                                      : stack_peek(0);
-                    runtime_error("Operands must both be numbers or strings but found '%s'", value_to_temp_cstr(value));
-                    return RESULT_RUNTIME_ERROR;
+                    ADD_TYPE_ERROR();
                 }
-                break;
-            case OP_SUBTRACT:      BINARY_OP(VALUE_NUMBER, -); break;
-            case OP_MULTIPLY:      BINARY_OP(VALUE_NUMBER, *); break;
-            case OP_DIVIDE:        BINARY_OP(VALUE_NUMBER, /); break;
-            case OP_NOT:           stack_push(VALUE_BOOL(!value_is_truthy(stack_pop()))); break;
-            case OP_NEGATE:        UNARY_OP(*= -1); break;
-            case OP_INCR:          UNARY_OP(++); break;
-            case OP_DECR:          UNARY_OP(--); break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                hashmap_set(&vm.globals, name, stack_peek(0));
-                stack_pop();
-            } break;
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!hashmap_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'", name->cstr);
-                    return RESULT_RUNTIME_ERROR;
+                DISPATCH();
+            }
+            CASE(OP_ADD_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    REWRITE_OPCODE(OP_ADD);
+                    DISPATCH();
                 }
-                stack_push(value);
-            } break;
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                // Set doesn't pop since assignment expression should evaluate to the RHS.
-                if (hashmap_set(&vm.globals, name, stack_peek(0))) {
-                    hashmap_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'", name->cstr);
-                    return RESULT_RUNTIME_ERROR;
+                double b = AS_NUMBER(POP());
+                PEEK(0) = VALUE_NUMBER(AS_NUMBER(PEEK(0)) + b);
+                DISPATCH();
+            }
+            CASE(OP_ADD_STRING): {
+                if (!is_object_type(PEEK(0), OBJ_STRING) || !is_object_type(PEEK(1), OBJ_STRING)) {
+                    REWRITE_OPCODE(OP_ADD);
+                    DISPATCH();
                 }
-            } break;
-            case OP_GET_LOCAL:   stack_push(vm.coroutine->frame->slots[READ_U8()]); break;
-            case OP_SET_LOCAL:   vm.coroutine->frame->slots[READ_U8()] = stack_peek(0); break;
-            case OP_GET_UPVALUE: stack_push(*vm.coroutine->frame->closure->upvalues[READ_U8()]->location); break;
-            case OP_SET_UPVALUE: *vm.coroutine->frame->closure->upvalues[READ_U8()]->location = stack_peek(0); break;
-            case OP_PRINT:       printf("%s\n", value_to_temp_cstr(stack_pop())); break;
-            case OP_CONCAT:      {
+                ADD_STRINGS();
+                DISPATCH();
+            }
+            CASE(OP_ADD_LOCAL_CONSTANT): {
+                Value a = slots[READ_U8()];
+                Value b = READ_CONST();
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH(VALUE_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                if (is_object_type(a, OBJ_STRING) && is_object_type(b, OBJ_STRING)) {
+                    ADD_STRINGS();
+                } else {
+                    ADD_TYPE_ERROR();
+                }
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT): BINARY_OP(VALUE_NUMBER, -); DISPATCH();
+            CASE(OP_MULTIPLY): BINARY_OP(VALUE_NUMBER, *); DISPATCH();
+            CASE(OP_DIVIDE): BINARY_OP(VALUE_NUMBER, /); DISPATCH();
+            CASE(OP_NOT): PEEK(0) = VALUE_BOOL(!value_is_truthy(PEEK(0))); DISPATCH();
+            CASE(OP_NEGATE): UNARY_OP(*= -1); DISPATCH();
+            CASE(OP_INCR): UNARY_OP(++); DISPATCH();
+            CASE(OP_DECR): UNARY_OP(--); DISPATCH();
+            CASE(OP_DEFINE_GLOBAL): {
+                uint16_t slot = READ_U16();
+                vm.globals.values[slot] = PEEK(0);
+                POPN(1);
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL): {
+                uint16_t slot = READ_U16();
+                Value value = vm.globals.values[slot];
+                if (IS_UNDEFINED(value)) RUNTIME_ERROR("Undefined variable '%s'", global_name(slot)->cstr);
+                PUSH(value);
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL): {
+                uint16_t slot = READ_U16();
+                Value *global = &vm.globals.values[slot];
+                if (IS_UNDEFINED(*global)) RUNTIME_ERROR("Undefined variable '%s'", global_name(slot)->cstr);
+                // Set doesn't pop since assignment expression should evaluate to the RHS.
+                *global = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL): PUSH(slots[READ_U8()]); DISPATCH();
+            CASE(OP_GET_LOCAL2): {
+                PUSH(slots[READ_U8()]);
+                PUSH(slots[READ_U8()]);
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL): slots[READ_U8()] = PEEK(0); DISPATCH();
+            CASE(OP_GET_UPVALUE): PUSH(*frame->closure->upvalues[READ_U8()]->location); DISPATCH();
+            CASE(OP_SET_UPVALUE): *frame->closure->upvalues[READ_U8()]->location = PEEK(0); DISPATCH();
+            CASE(OP_PRINT): printf("%s\n", value_to_temp_cstr(POP())); DISPATCH();
+            CASE(OP_CONCAT): {
                 uint8_t parts = READ_U8();
                 uint32_t length = 0;
-                for (uint8_t i = 0; i < parts; i++) length += strlen(value_to_temp_cstr(stack_peek(i)));
+                for (uint8_t i = 0; i < parts; i++) length += strlen(value_to_temp_cstr(PEEK(i)));
 
+                SAVE_STATE();
                 ObjString *string = create_new_string(length);
                 char *current = string->cstr;
                 for (int i = parts - 1; i >= 0; i--) {
-                    const char *part = value_to_temp_cstr(stack_peek(i));
+                    const char *part = value_to_temp_cstr(PEEK(i));
                     uint32_t length = strlen(part);
 
                     memcpy(current, part, length);
                     current += length;
                 }
-                stack_popn(parts);
-                stack_push(VALUE_OBJECT(finish_new_string(string, length)));
-            } break;
-            case OP_JUMP: {
+                POPN(parts);
+                SAVE_STATE();
+                PUSH(VALUE_OBJECT(finish_new_string(string, length)));
+                DISPATCH();
+            }
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_U16();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_U16();
-                vm.coroutine->frame->ip += offset;
-            } break;
-            case OP_JUMP_IF_FALSE: {
+                if (!value_is_truthy(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_TRUE): {
                 uint16_t offset = READ_U16();
-                if (!value_is_truthy(stack_peek(0))) vm.coroutine->frame->ip += offset;
-            } break;
-            case OP_JUMP_IF_TRUE: {
+                if (value_is_truthy(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, false); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_EQUAL): EQUAL_JUMP(false); DISPATCH();
+            CASE(OP_JUMP_IF_LESS): COMPARE_JUMP(<, true); DISPATCH();
+            CASE(OP_JUMP_IF_GREATER): COMPARE_JUMP(>, true); DISPATCH();
+            CASE(OP_JUMP_IF_EQUAL): EQUAL_JUMP(true); DISPATCH();
+            CASE(OP_FOR_LOOP): {
+                Value *counter = &slots[READ_U8()];
                 uint16_t offset = READ_U16();
-                if (value_is_truthy(stack_peek(0))) vm.coroutine->frame->ip += offset;
-            } break;
-            case OP_LOOP: {
+                Value limit = POP();
+                if (!IS_NUMBER(*counter) || !IS_NUMBER(limit)) {
+                    if (!IS_NUMBER(*counter)) {
+                        RUNTIME_ERROR("Operand must be a number but found '%s'", value_to_temp_cstr(*counter));
+                    }
+                    RUNTIME_ERROR("Operands must be numbers but found '%s'", value_to_temp_cstr(limit));
+                }
+
+                double next = AS_NUMBER(*counter) + 1;
+                *counter = VALUE_NUMBER(next);
+                if (next < AS_NUMBER(limit)) ip -= offset;
+                DISPATCH();
+            }
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_U16();
-                vm.coroutine->frame->ip -= offset;
-            } break;
-            case OP_CALL: {
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(OP_CALL): {
+                uint8_t arg_num = READ_U8();
+                SAVE_STATE();
+                if (!call_value(PEEK(arg_num), arg_num)) return RESULT_RUNTIME_ERROR;
+                LOAD_STATE();
+                DISPATCH();
+            }
+            CASE(OP_TAIL_CALL): {
                 uint8_t arg_num = READ_U8();
-                if (!call_value(stack_peek(arg_num), arg_num)) return RESULT_RUNTIME_ERROR;
-            } break;
-            case OP_CLOSURE: {
-                ObjClosure *closure = new_closure((ObjFunction *) READ_CONST().as.object);
-                stack_push(VALUE_OBJECT(closure));
+                Value callee = PEEK(arg_num);
+                ObjClosure *closure = is_object_type(callee, OBJ_CLOSURE) ? (ObjClosure *) AS_OBJECT(callee) : NULL;
+                // Anything but a synchronous closure with matching arity is called normally, errors included.
+                if (closure == NULL || closure->function->is_async ||
+                    closure->function->arity != arg_num) {
+                    ip--;
+                    CONTINUE_AS(OP_CALL);
+                }
+
+                // The callee may need more stack than the caller whose frame it takes over.
+                if (!frame_fits(vm.coroutine, slots, closure->function)) {
+                    SAVE_STATE();
+                    grow_stack_for_frame(vm.coroutine, slots, closure->function);
+                    LOAD_STATE();
+                }
+
+                close_upvalues(slots);
+                memmove(slots, stack_top - arg_num - 1, sizeof(*slots) * (arg_num + 1));
+                stack_top = slots + arg_num + 1;
+                frame->closure = closure;
+                ip = closure->function->chunk.code;
+                DISPATCH();
+            }
+            CASE(OP_SPAWN): {
+                uint8_t arg_num = READ_U8();
+                Value callee = PEEK(arg_num);
+                if (!is_object_type(callee, OBJ_CLOSURE) || !((ObjClosure *) AS_OBJECT(callee))->function->is_async) {
+                    ip--;
+                    CONTINUE_AS(OP_CALL);
+                }
+
+                SAVE_STATE();
+                if (!call((ObjClosure *) AS_OBJECT(callee), arg_num)) return RESULT_RUNTIME_ERROR;
+                vm.coroutine->frame->is_spawned = true;
+                LOAD_STATE();
+                DISPATCH();
+            }
+            CASE(OP_CLOSURE): {
+                ObjFunction *function = (ObjFunction *) AS_OBJECT(READ_CONST());
+                SAVE_STATE();
+                ObjClosure *closure = new_closure(function);
+                PUSH(VALUE_OBJECT(closure));
+                // Keep the closure rooted while capturing upvalues allocates.
+                SAVE_STATE();
 
                 for (uint32_t i = 0; i < closure->upvalues_length; i++) {
                     uint8_t is_local = READ_U8();
                     uint8_t index = READ_U8();
 
                     if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(&vm.coroutine->frame->slots[index]);
+                        closure->upvalues[i] = capture_upvalue(&slots[index]);
                     } else {
-                        closure->upvalues[i] = vm.coroutine->frame->closure->upvalues[index];
+                        closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
-            } break;
-            case OP_CLOSE_UPVALUE:
-                close_upvalues(vm.coroutine->stack_top - 1);
-                stack_pop();
-                break;
-            case OP_RETURN: {
+                DISPATCH();
+            }
+            CASE(OP_CLOSE_UPVALUE): {
+                close_upvalues(stack_top - 1);
+                POPN(1);
+                DISPATCH();
+            }
+            CASE(OP_RETURN): {
                 // Save return value.
-                Value return_value = stack_pop();
+                Value return_value = POP();
 
                 // Close upvalues.
-                close_upvalues(vm.coroutine->frame->slots);
+                close_upvalues(slots);
 
                 // Check if it's the last callframe in the coroutine.
-                if (vm.coroutine->frame == vm.coroutine->frames) {
+                if (frame == vm.coroutine->frames) {
                     Coroutine *finished = ll_remove(&vm.active_head, &vm.coroutine);
-                    if (is_object_type(return_value, OBJ_PROMISE)) {
-                        ObjPromise *promise = (ObjPromise *) return_value.as.object;
+                    // Coroutines of spawned calls and scripts have no promise, nobody waits for them.
+                    ObjPromise *finished_promise = finished->promise;
+                    if (finished_promise != NULL && is_object_type(return_value, OBJ_PROMISE)) {
+                        ObjPromise *promise = (ObjPromise *) AS_OBJECT(return_value);
                         if (promise->is_fulfilled) {
-                            fulfill_promise(finished->promise, promise->data.value);
+                            fulfill_promise(finished_promise, promise->data.value);
                         } else {
-                            promise->next = finished->promise;
+                            promise->next = finished_promise;
                         }
-                    } else {
-                        fulfill_promise(finished->promise, return_value);
+                    } else if (finished_promise != NULL) {
+                        fulfill_promise(finished_promise, return_value);
                     }
-                    free(finished);
+                    release_coroutine(finished);
                     SCHEDULE_COROUTINE();
+                    LOAD_STATE();
                 } else {
+                    bool needs_promise = frame->closure->function->is_async && !frame->is_spawned;
+
                     // Pop frame and its stack.
-                    vm.coroutine->stack_top = vm.coroutine->frame->slots;
-                    vm.coroutine->frame--;
+                    stack_top = slots;
+                    frame = --vm.coroutine->frame;
+                    ip = frame->ip;
+                    slots = frame->slots;
 
                     // Restore return value.
-                    stack_push(return_value);
+                    PUSH(return_value);
+
+                    // Async functions that never suspended give their caller an already fulfilled promise.
+                    if (needs_promise && !is_object_type(return_value, OBJ_PROMISE)) {
+                        SAVE_STATE();
+                        ObjPromise *promise = new_promise();
+                        fulfill_promise(promise, return_value);
+                        PEEK(0) = VALUE_OBJECT(promise);
+                    }
                 }
-            } break;
-            case OP_CLASS:  stack_push(VALUE_OBJECT(new_class(READ_STRING()))); break;
-            case OP_METHOD: {
-                ObjClass *class = (ObjClass *) stack_peek(1).as.object;
-                hashmap_set(&class->methods, READ_STRING(), stack_peek(0));
-                stack_pop();
-            } break;
-            case OP_INHERIT: {
-                Value superclass_value = stack_peek(1);
+                DISPATCH();
+            }
+            CASE(OP_CLASS): {
+                ObjString *name = READ_STRING();
+                SAVE_STATE();
+                PUSH(VALUE_OBJECT(new_class(name)));
+                DISPATCH();
+            }
+            CASE(OP_METHOD): {
+                ObjClass *class = (ObjClass *) AS_OBJECT(PEEK(1));
+                ObjString *name = READ_STRING();
+                SAVE_STATE();
+                hashmap_set(&class->methods, name, PEEK(0));
+#ifdef INLINE_CACHING
+                // Orphans the class's entries in the method cache.
+                class->id = next_id();
+#endif
+                POPN(1);
+                DISPATCH();
+            }
+            CASE(OP_INHERIT): {
+                Value superclass_value = PEEK(1);
                 if (!is_object_type(superclass_value, OBJ_CLASS)) {
-                    runtime_error("Superclass must be a class but found '%s'", value_to_temp_cstr(superclass_value));
-                    return RESULT_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class but found '%s'", value_to_temp_cstr(superclass_value));
                 }
-                ObjClass *superclass = (ObjClass *) superclass_value.as.object;
-                ObjClass *subclass = (ObjClass *) stack_peek(0).as.object;
+                ObjClass *superclass = (ObjClass *) AS_OBJECT(superclass_value);
+                ObjClass *subclass = (ObjClass *) AS_OBJECT(PEEK(0));
+                SAVE_STATE();
                 hashmap_set_all(&superclass->methods, &subclass->methods);
-                stack_pop();
-            } break;
-            case OP_GET_FIELD: {
-                Value instance_value = stack_peek(0);
+#ifdef INLINE_CACHING
+                subclass->id = next_id();
+#endif
+                POPN(1);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL_FIELD): {
+                PUSH(slots[READ_U8()]);
+                CONTINUE_AS(OP_GET_FIELD);
+            }
+            CASE(OP_GET_FIELD): {
+                Value instance_value = PEEK(0);
                 ObjString *field = READ_STRING();
+#ifdef INLINE_CACHING
+                uint8_t *cache_ip = ip;
+                ip += sizeof(PropertyCache);
+#endif
 
                 if (is_object_type(instance_value, OBJ_INSTANCE)) {
-                    ObjInstance *instance = (ObjInstance *) instance_value.as.object;
+                    ObjInstance *instance = (ObjInstance *) AS_OBJECT(instance_value);
+
+#ifdef INLINE_CACHING
+                    PropertyCache cache;
+                    memcpy(&cache, cache_ip, sizeof(cache));
+                    if (instance->shape != NULL && instance->shape->id == cache.shape_id) {
+                        if (cache.as.method == NULL) {
+                            PEEK(0) = *instance_slot(instance, cache.slot);
+                        } else {
+                            SAVE_STATE();
+                            PEEK(0) = VALUE_OBJECT(new_bound_method(instance_value, cache.as.method));
+                        }
+                        DISPATCH();
+                    }
+#endif
 
                     Value value;
-                    if (hashmap_get(&instance->fields, field, &value)) {
-                        stack_pop();
-                        stack_push(value);
-                        break;
+                    if (instance_get_field(instance, field, &value)) {
+#ifdef INLINE_CACHING
+                        if (instance->shape != NULL) {
+                            cache = (PropertyCache) {
+                                .shape_id = instance->shape->id,
+                                .slot = shape_find_slot(instance->shape, field),
+                            };
+                            memcpy(cache_ip, &cache, sizeof(cache));
+                        }
+#endif
+                        PEEK(0) = value;
+                        DISPATCH();
                     }
-                    if (hashmap_get(&instance->class->methods, field, &value)) {
-                        ObjBoundMethod *bound_method = new_bound_method(instance_value, (ObjClosure *) value.as.object);
-                        stack_pop();
-                        stack_push(VALUE_OBJECT(bound_method));
-                        break;
+                    ObjClosure *method;
+                    if (find_method(instance->class, field, &method)) {
+#ifdef INLINE_CACHING
+                        // Methods can't change once the class is defined, so the shape also identifies the method.
+                        if (instance->shape != NULL) {
+                            cache = (PropertyCache) {.shape_id = instance->shape->id, .as.method = method};
+                            memcpy(cache_ip, &cache, sizeof(cache));
+                        }
+#endif
+                        SAVE_STATE();
+                        PEEK(0) = VALUE_OBJECT(new_bound_method(instance_value, method));
+                        DISPATCH();
                     }
 
-                    runtime_error("Undefined field '%s'", field->cstr);
-                    return RESULT_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined field '%s'", field->cstr);
                 } else if (is_object_type(instance_value, OBJ_STRING)) {
                     if (field != vm.length_string) {
-                        runtime_error("Undefined field '%s', strings only have length", field->cstr);
-                        return RESULT_RUNTIME_ERROR;
+                        RUNTIME_ERROR("Undefined field '%s', strings only have length", field->cstr);
                     }
 
-                    ObjString *string = (ObjString *) instance_value.as.object;
-                    stack_pop();
-                    stack_push(VALUE_NUMBER(string->length));
+                    ObjString *string = (ObjString *) AS_OBJECT(instance_value);
+                    PEEK(0) = VALUE_NUMBER(string->length);
                 } else if (is_object_type(instance_value, OBJ_ARRAY)) {
                     if (field != vm.length_string) {
-                        runtime_error("Undefined field '%s', arrays only have length", field->cstr);
-                        return RESULT_RUNTIME_ERROR;
+                        RUNTIME_ERROR("Undefined field '%s', arrays only have length", field->cstr);
                     }
 
-                    ObjArray *array = (ObjArray *) instance_value.as.object;
-                    stack_pop();
-                    stack_push(VALUE_NUMBER(array->length));
+                    ObjArray *array = (ObjArray *) AS_OBJECT(instance_value);
+                    PEEK(0) = VALUE_NUMBER(array->length);
                 } else {
-                    runtime_error("Fields only exist on instances but found '%s'", value_to_temp_cstr(instance_value));
-                    return RESULT_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Fields only exist on instances but found '%s'", value_to_temp_cstr(instance_value));
                 }
-            } break;
-            case OP_SET_FIELD: {
-                Value instance_value = stack_peek(1);
+                DISPATCH();
+            }
+            CASE(OP_SET_FIELD): {
+                Value instance_value = PEEK(1);
                 ObjString *field = READ_STRING();
+#ifdef INLINE_CACHING
+                uint8_t *cache_ip = ip;
+                ip += sizeof(PropertyCache);
+#endif
                 if (!is_object_type(instance_value, OBJ_INSTANCE)) {
                     if ((is_object_type(instance_value, OBJ_ARRAY) || is_object_type(instance_value, OBJ_STRING))
                         && field == vm.length_string) {
-                        runtime_error("Cannot assign to length, it is immutable");
+                        RUNTIME_ERROR("Cannot assign to length, it is immutable");
+                    }
+                    RUNTIME_ERROR("Fields only exist on instances but found '%s'", value_to_temp_cstr(instance_value));
+                }
+                ObjInstance *instance = (ObjInstance *) AS_OBJECT(instance_value);
+                Value value = PEEK(0);
+
+#ifdef INLINE_CACHING
+                PropertyCache cache;
+                memcpy(&cache, cache_ip, sizeof(cache));
+                if (instance->shape != NULL && instance->shape->id == cache.shape_id) {
+                    if (cache.as.transition == NULL) {
+                        *instance_slot(instance, cache.slot) = value;
+                        POPN(1);
+                        PEEK(0) = value;
+                        DISPATCH();
+                    }
+                    // Adding a field only takes the fast path if there is free capacity for it.
+                    if (cache.slot < instance->inline_capacity + instance->overflow_capacity) {
+                        instance->shape = cache.as.transition;
+                        *instance_slot(instance, cache.slot) = value;
+                        POPN(1);
+                        PEEK(0) = value;
+                        DISPATCH();
+                    }
+                }
+                ObjShape *old_shape = instance->shape;
+#endif
+
+                SAVE_STATE();
+                instance_set_field(instance, field, value);
+
+#ifdef INLINE_CACHING
+                if (old_shape != NULL && instance->shape != NULL) {
+                    if (instance->shape == old_shape) {
+                        cache = (PropertyCache) {.shape_id = old_shape->id, .slot = shape_find_slot(old_shape, field)};
                     } else {
-                        runtime_error("Fields only exist on instances but found '%s'",
-                                      value_to_temp_cstr(instance_value));
+                        cache = (PropertyCache) {
+                            .shape_id = old_shape->id,
+                            .slot = instance->shape->length - 1,
+                            .as.transition = instance->shape,
+                        };
                     }
-                    return RESULT_RUNTIME_ERROR;
+                    memcpy(cache_ip, &cache, sizeof(cache));
                 }
-                ObjInstance *instance = (ObjInstance *) instance_value.as.object;
-
-                Value value = stack_peek(0);
-                hashmap_set(&instance->fields, field, value);
-                stack_popn(2);
-                stack_push(value);
-            } break;
-            case OP_INVOKE: {
+#endif
+                POPN(1);
+                PEEK(0) = value;
+                DISPATCH();
+            }
+            CASE(OP_INVOKE): {
                 ObjString *name = READ_STRING();
                 uint8_t arg_num = READ_U8();
 #ifdef INLINE_CACHING
-                uint8_t *cache_ip = vm.coroutine->frame->ip;
-                vm.coroutine->frame->ip += sizeof(cache_id_t) + sizeof(void *);
+                uint8_t *cache_ip = ip;
+                ip += sizeof(InvokeCache);
 #endif
 
-                Value instance_value = stack_peek(arg_num);
+                Value instance_value = PEEK(arg_num);
                 if (!is_object_type(instance_value, OBJ_INSTANCE)) {
-                    runtime_error("Fields only exist on instances but found '%s'", value_to_temp_cstr(instance_value));
-                    return RESULT_RUNTIME_ERROR;
-                }
-                ObjInstance *instance = (ObjInstance *) instance_value.as.object;
-
-                Value value;
-                if (hashmap_get(&instance->fields, name, &value)) {
-                    *(vm.coroutine->stack_top - arg_num - 1) = value;
-                    if (!call_value(value, arg_num)) return RESULT_RUNTIME_ERROR;
-                    break;
+                    RUNTIME_ERROR("Fields only exist on instances but found '%s'", value_to_temp_cstr(instance_value));
                 }
+                ObjInstance *instance = (ObjInstance *) AS_OBJECT(instance_value);
+                SAVE_STATE();
 
 #ifdef INLINE_CACHING
-                if (memcmp(cache_ip, &instance->class->id, sizeof(cache_id_t)) == 0) {
-                    ObjClosure *cached_method;
-                    memcpy(&cached_method, cache_ip + sizeof(cache_id_t), sizeof(void *));
-                    assert(cached_method != NULL);
-
-                    if (!call(cached_method, arg_num)) return RESULT_RUNTIME_ERROR;
-                    break;
+                // Entries are only added for shapes without a field of that name, so a hit can call right away.
+                cache_id_t shape_ids[INVOKE_CACHE_SIZE];
+                memcpy(shape_ids, cache_ip + offsetof(InvokeCache, shape_ids), sizeof(shape_ids));
+                uint8_t *methods_ip = cache_ip + offsetof(InvokeCache, methods);
+                int32_t hit_entry = -1;
+                int32_t free_entry = -1;
+                if (instance->shape != NULL) {
+                    for (int32_t i = 0; i < INVOKE_CACHE_SIZE; i++) {
+                        if (shape_ids[i] == instance->shape->id) {
+                            hit_entry = i;
+                            break;
+                        }
+                        if (shape_ids[i] == 0 && free_entry == -1) free_entry = i;
+                    }
+                }
+                // Dispatching from inside the loop would only continue the loop when dispatch is a switch.
+                if (hit_entry != -1) {
+                    INVOKE_CACHE_STAT(hits);
+                    ObjClosure *method;
+                    memcpy(&method, methods_ip + hit_entry * sizeof(method), sizeof(method));
+                    if (!call(method, arg_num)) return RESULT_RUNTIME_ERROR;
+                    LOAD_STATE();
+                    DISPATCH();
                 }
+                INVOKE_CACHE_STAT(misses);
 #endif
 
-                if (hashmap_get(&instance->class->methods, name, &value)) {
+                Value value;
+                if (instance_get_field(instance, name, &value)) {
+                    PEEK(arg_num) = value;
+                    if (!call_value(value, arg_num)) return RESULT_RUNTIME_ERROR;
+                    LOAD_STATE();
+                    DISPATCH();
+                }
+
+                ObjClosure *method;
+                if (find_method(instance->class, name, &method)) {
 #ifdef INLINE_CACHING
-                    memcpy(cache_ip, &instance->class->id, sizeof(cache_id_t));
-                    memcpy(cache_ip + sizeof(cache_id_t), &value.as.object, sizeof(void *));
+                    if (free_entry != -1) {
+                        shape_ids[free_entry] = instance->shape->id;
+                        memcpy(cache_ip + offsetof(InvokeCache, shape_ids), shape_ids, sizeof(shape_ids));
+                        memcpy(methods_ip + free_entry * sizeof(method), &method, sizeof(method));
+                    } else if (instance->shape != NULL) {
+                        // All entries are taken, they are kept as they are instead of thrashing.
+                        INVOKE_CACHE_STAT(megamorphic);
+                    }
 #endif
-                    if (!call((ObjClosure *) value.as.object, arg_num)) return RESULT_RUNTIME_ERROR;
-                    break;
+                    if (!call(method, arg_num)) return RESULT_RUNTIME_ERROR;
+                    LOAD_STATE();
+                    DISPATCH();
                 }
 
-                runtime_error("Undefined field '%s'", name->cstr);
-                return RESULT_RUNTIME_ERROR;
-            } break;
-            case OP_GET_SUPER: {
+                RUNTIME_ERROR("Undefined field '%s'", name->cstr);
+            }
+            CASE(OP_GET_SUPER): {
                 ObjString *name = READ_STRING();
-                ObjClass *superclass = (ObjClass *) stack_pop().as.object;
+                ObjClass *superclass = (ObjClass *) AS_OBJECT(POP());
 
-                Value value;
-                if (!hashmap_get(&superclass->methods, name, &value)) {
-                    runtime_error("Undefined superclass method '%s'", name->cstr);
-                    return RESULT_RUNTIME_ERROR;
+                ObjClosure *method;
+                if (!find_method(superclass, name, &method)) {
+                    RUNTIME_ERROR("Undefined superclass method '%s'", name->cstr);
                 }
 
-                ObjBoundMethod *bound_method = new_bound_method(stack_peek(0), (ObjClosure *) value.as.object);
-                stack_pop();
-                stack_push(VALUE_OBJECT(bound_method));
-            } break;
-            case OP_SUPER_INVOKE: {
+                SAVE_STATE();
+                ObjBoundMethod *bound_method = new_bound_method(PEEK(0), method);
+                PEEK(0) = VALUE_OBJECT(bound_method);
+                DISPATCH();
+            }
+            CASE(OP_SUPER_INVOKE): {
                 ObjString *name = READ_STRING();
                 uint8_t arg_num = READ_U8();
-                ObjClass *superclass = (ObjClass *) stack_pop().as.object;
+                ObjClass *superclass = (ObjClass *) AS_OBJECT(POP());
 
 #ifdef INLINE_CACHING
-                uint8_t *cache_ip = vm.coroutine->frame->ip;
-                vm.coroutine->frame->ip += sizeof(void *);
+                uint8_t *cache_ip = ip;
+                ip += sizeof(void *);
+#endif
+                SAVE_STATE();
 
+#ifdef INLINE_CACHING
                 ObjClosure *cached_method;
                 memcpy(&cached_method, cache_ip, sizeof(void *));
                 if (cached_method != NULL) {
                     if (!call(cached_method, arg_num)) return RESULT_RUNTIME_ERROR;
-                    break;
+                    LOAD_STATE();
+                    DISPATCH();
                 }
 #endif
 
-                Value value;
-                if (hashmap_get(&superclass->methods, name, &value)) {
+                ObjClosure *method;
+                if (find_method(superclass, name, &method)) {
 #ifdef INLINE_CACHING
-                    memcpy(cache_ip, &value.as.object, sizeof(void *));
+                    memcpy(cache_ip, &method, sizeof(void *));
 #endif
-                    if (!call((ObjClosure *) value.as.object, arg_num)) return RESULT_RUNTIME_ERROR;
-                    break;
+                    if (!call(method, arg_num)) return RESULT_RUNTIME_ERROR;
+                    LOAD_STATE();
+                    DISPATCH();
                 }
 
-                runtime_error("Undefined superclass method '%s'", name->cstr);
-                return RESULT_RUNTIME_ERROR;
-            } break;
-            case OP_YIELD:
+                RUNTIME_ERROR("Undefined superclass method '%s'", name->cstr);
+            }
+            CASE(OP_YIELD): {
+                SAVE_STATE();
+                materialize_eager_call();
                 vm.coroutine = vm.coroutine->next;
                 SCHEDULE_COROUTINE();
-                break;
-            case OP_AWAIT: {
-                Value promise_value = stack_peek(0);
+                LOAD_STATE();
+                DISPATCH();
+            }
+            CASE(OP_AWAIT): {
+                Value promise_value = PEEK(0);
                 if (!is_object_type(promise_value, OBJ_PROMISE)) {
-                    runtime_error("Operand must be a promise but found '%s'", value_to_temp_cstr(promise_value));
-                    return RESULT_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a promise but found '%s'", value_to_temp_cstr(promise_value));
                 }
-                ObjPromise *promise = (ObjPromise *) promise_value.as.object;
+                ObjPromise *promise = (ObjPromise *) AS_OBJECT(promise_value);
 
                 if (promise->is_fulfilled) {
-                    stack_pop();
-                    stack_push(promise->data.value);
+                    PEEK(0) = promise->data.value;
                 } else {
+                    SAVE_STATE();
+                    materialize_eager_call();
                     Coroutine *waiting = ll_remove(&vm.active_head, &vm.coroutine);
                     promise_add_coroutine(promise, waiting);
                     SCHEDULE_COROUTINE();
+                    LOAD_STATE();
                 }
-            } break;
-            case OP_ARRAY: {
+                DISPATCH();
+            }
+            CASE(OP_ARRAY): {
                 uint32_t elements = READ_U8();
+                SAVE_STATE();
                 ObjArray *array = new_array(elements, VALUE_NIL());
-                stack_popn(elements);
-                memcpy(array->elements, vm.coroutine->stack_top, elements * sizeof(*array->elements));
-                stack_push(VALUE_OBJECT(array));
-            } break;
-            case OP_ARRAY_GET: {
-                if (!check_int_arg(stack_peek(0), 0, UINT32_MAX)) {
-                    runtime_error("Index must be a positive integer but found '%s'", value_to_temp_cstr(stack_peek(0)));
-                    return RESULT_RUNTIME_ERROR;
-                }
-                uint32_t index = (uint32_t) stack_pop().as.number;
-
-                Value value = stack_pop();
-                if (is_object_type(value, OBJ_ARRAY)) {
-                    ObjArray *array = (ObjArray *) value.as.object;
-                    if (index >= array->length) {
-                        runtime_error("Index out of bounds");
-                        return RESULT_RUNTIME_ERROR;
-                    }
-
-                    stack_push(array->elements[index]);
-                } else if (is_object_type(value, OBJ_STRING)) {
-                    ObjString *string = (ObjString *) value.as.object;
-                    if (index >= string->length) {
-                        runtime_error("Index out of bounds");
-                        return RESULT_RUNTIME_ERROR;
-                    }
-
-                    stack_push(VALUE_OBJECT(copy_string(&string->cstr[index], 1)));
-                } else {
-                    runtime_error("Expected an array or a string but found '%s'", value_to_temp_cstr(value));
-                    return RESULT_RUNTIME_ERROR;
-                }
-            } break;
-            case OP_ARRAY_SET: {
-                Value value = stack_pop();
-
-                if (!check_int_arg(stack_peek(0), 0, UINT32_MAX)) {
-                    runtime_error("Index must be a positive integer but found '%s'", value_to_temp_cstr(stack_peek(0)));
-                    return RESULT_RUNTIME_ERROR;
-                }
-                uint32_t index = (uint32_t) stack_pop().as.number;
-
-                Value array_value = stack_pop();
-                if (!is_object_type(array_value, OBJ_ARRAY)) {
-                    runtime_error("Expected an array but found '%s'", value_to_temp_cstr(array_value));
-                    return RESULT_RUNTIME_ERROR;
-                }
-                ObjArray *array = (ObjArray *) array_value.as.object;
-
-                if (index >= array->length) {
-                    runtime_error("Index out of bounds");
-                    return RESULT_RUNTIME_ERROR;
-                }
-                array->elements[index] = value;
-                stack_push(value);
-            } break;
-            case OP_ARRAY_INCR: ARRAY_UNARY_OP(++); break;
-            case OP_ARRAY_DECR: ARRAY_UNARY_OP(--); break;
-            default:            UNREACHABLE();
+                POPN(elements);
+                memcpy(array->elements, stack_top, elements * sizeof(*array->elements));
+                PUSH(VALUE_OBJECT(array));
+                DISPATCH();
+            }
+            CASE(OP_ARRAY_GET): CHECK_INDEX(PEEK(0)); CONTINUE_AS(OP_ARRAY_GET_COUNTER);
+            CASE(OP_ARRAY_GET_COUNTER): ARRAY_GET(COUNTER_INDEX(PEEK(0))); DISPATCH();
+            CASE(OP_ARRAY_SET): CHECK_INDEX(PEEK(1)); CONTINUE_AS(OP_ARRAY_SET_COUNTER);
+            CASE(OP_ARRAY_SET_COUNTER): ARRAY_SET(COUNTER_INDEX(PEEK(1))); DISPATCH();
+            CASE(OP_ARRAY_INCR): ARRAY_UNARY_OP(++); DISPATCH();
+            CASE(OP_ARRAY_DECR): ARRAY_UNARY_OP(--); DISPATCH();
+            default: UNREACHABLE();
         }
     }
 
+#undef SAVE_STATE
+#undef LOAD_STATE
 #undef READ_U8
 #undef READ_U16
 #undef READ_CONST
 #undef READ_STRING
+#undef PUSH
+#undef POP
+#undef POPN
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef REWRITE_OPCODE
+#undef ADD_STRINGS
+#undef ADD_TYPE_ERROR
 #undef UNARY_OP
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef CHECK_INDEX
+#undef COUNTER_INDEX
+#undef ARRAY_GET
+#undef ARRAY_SET
 #undef ARRAY_UNARY_OP
 #undef SCHEDULE_COROUTINE
+#undef INVOKE_CACHE_STAT
+#undef TRACE_EXECUTION
+#undef CASE
+#undef DISPATCH
+#undef CONTINUE_AS
 }
 
 void init_vm(void) {
     vm.coroutine = vm.active_head = new_coroutine();
+#ifdef IO_URING
+    vm.has_uring = uring_init(&vm.uring, URING_ENTRIES);
+#endif
     vm.epoll_fd = epoll_create1(0);
     if (vm.epoll_fd == -1) PANIC("Error in epoll_create: %s", strerror(errno));
     vm.next_gc = GC_INITIAL_THRESHOLD;
     vm.init_string = copy_string("init", 4);
     vm.length_string = copy_string("length", 6);
+    vm.request_class = new_class(copy_string("Request", 7));
+    vm.headers_class = new_class(copy_string("Headers", 7));
 
     add_native_functions();
 }
 
 void free_vm(void) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+    fprintf(stderr, "invoke cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " megamorphic\n",
+            vm.invoke_cache_stats.hits, vm.invoke_cache_stats.misses, vm.invoke_cache_stats.megamorphic);
+    fprintf(stderr, "method cache: %" PRIu64 " hits, %" PRIu64 " misses\n", vm.method_cache_stats.hits,
+            vm.method_cache_stats.misses);
+#endif
+
+#ifdef IO_URING
+    // Operations still in the kernel are cancelled when the ring is closed.
+    if (vm.has_uring) uring_free(&vm.uring);
+#endif
     close(vm.epoll_fd);
+    for (uint32_t fd = 0; fd < vm.io_states_capacity; fd++) {
+        IoState *state = &vm.io_states[fd];
+        IoWaiter *waiters[] = {state->readers_head, state->writers_head};
+        for (uint32_t i = 0; i < sizeof(waiters) / sizeof(*waiters); i++) {
+            for (IoWaiter *waiter = waiters[i]; waiter != NULL;) {
+                IoWaiter *next = waiter->next;
+                free(waiter);
+                waiter = next;
+            }
+        }
+    }
+    free(vm.io_states);
     free(vm.pinned_objects);
+    for (uint32_t i = 0; i < vm.timers_length; i++) free_coroutine(vm.timers[i].coroutine);
+    free(vm.timers);
     free(vm.grey_objects);
     free_hashmap(&vm.strings);
-    free_hashmap(&vm.globals);
+    free_hashmap(&vm.global_slots);
+    vm.globals.values = ARRAY_FREE(vm.globals.values, vm.globals.capacity);
 
     for (Object *current = vm.objects; current != NULL;) {
         Object *next = current->next;
@@ -902,17 +1886,28 @@ void free_vm(void) {
 
     for (Coroutine *current = vm.active_head; current != NULL;) {
         Coroutine *next = current->next;
-        free(current);
+        free_coroutine(current);
+        current = next;
+    }
+    for (Coroutine *current = vm.pooled_head; current != NULL;) {
+        Coroutine *next = current->next;
+        free_coroutine(current);
         current = next;
     }
 }
 
 InterpretResult interpret(const char *source) {
+    // In the REPL the previous line's coroutine has either finished or stopped at a runtime error.
+    if (vm.coroutine == NULL) vm.coroutine = vm.active_head = new_coroutine();
+    vm.coroutine->stack_top = vm.coroutine->stack;
+
     ObjFunction *script = compile(source);
     if (script == NULL) return RESULT_COMPILE_ERROR;
 
     ObjClosure *closure = new_closure(script);
     init_callstack(vm.coroutine, closure);
+    uint32_t depth = script->max_depth + STACK_HELPER_SLOTS;
+    if (vm.coroutine->stack + depth > vm.coroutine->stack_end) grow_stack(vm.coroutine, depth);
     stack_push(VALUE_OBJECT(closure));
 
     vm.enable_gc = true;
@@ -1,10 +1,11 @@
 #ifndef CLOX_VM_H_
 #define CLOX_VM_H_
 
-#include <sys/epoll.h>
+#include <sys/types.h>
 #include "compiler.h"
 #include "hashmap.h"
 #include "object.h"
+#include "uring.h"
 #include "value.h"
 
 typedef enum {
@@ -14,50 +15,153 @@ typedef enum {
     RESULT_RUNTIME_ERROR,
 } InterpretResult;
 
-#define CALLSTACK_SIZE 64
-#define STACK_SIZE (CALLSTACK_SIZE * LOCALS_SIZE)
+// Coroutine stacks start small and grow on demand, calls only fail when recursion gets this deep.
+#define CALLSTACK_INITIAL_SIZE 8
+#define CALLSTACK_MAX_SIZE (1 << 16)
+#define STACK_INITIAL_SIZE LOCALS_SIZE
+// Calls grow the stack to fit the most values the callee's frame has at once and this many more, which runtime
+// helpers push to keep objects they allocate from being collected.
+#define STACK_HELPER_SLOTS 4
+// With coroutines ready to run, the scheduler checks for IO events once every this many rounds over them.
+#define POLL_INTERVAL 8
+// Most IO events handled per epoll_wait call.
+#define EPOLL_MAX_EVENTS 256
+// Size of the io_uring submission queue, the completion queue is twice as big.
+#define URING_ENTRIES 256
+// Finished coroutines kept for reuse by async calls, only those whose stacks never grew are kept.
+#define COROUTINE_POOL_SIZE 256
 
 typedef struct {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+    // Set for async calls whose result is discarded, they never get a promise.
+    bool is_spawned;
 } CallFrame;
 
 typedef struct Coroutine {
     struct Coroutine *prev;
     struct Coroutine *next;
     ObjPromise *promise;
-    uint64_t sleep_time_ms;
     CallFrame *frame;
     Value *stack_top;
-    CallFrame frames[CALLSTACK_SIZE];
-    Value stack[STACK_SIZE];
+    // Upvalues that still point into the stack, sorted from the top of the stack.
+    ObjUpvalue *open_upvalues;
+    // Both allocations end right before their `_end` pointer.
+    CallFrame *frames;
+    CallFrame *frames_end;
+    Value *stack;
+    Value *stack_end;
 } Coroutine;
 
-struct EpollData;
-typedef bool (*EpollCallbackFn)(struct EpollData *data);
+typedef struct {
+    // Monotonic time in nanoseconds.
+    uint64_t wake_time_ns;
+    Coroutine *coroutine;
+} Timer;
+
+typedef enum {
+    IO_ACCEPT,
+    IO_RECV,
+    IO_SEND,
+    // Sends from `file_fd` to the socket.
+    IO_SENDFILE,
+} IoOperation;
+
+typedef enum {
+    IO_DONE,
+    // Run the operation again, e.g. to write the rest after a partial write.
+    IO_AGAIN,
+    IO_ERROR,
+} IoStatus;
+
+struct IoWaiter;
+// Handles the result of the operation's syscall, a negative errno on failure, and sets `value` to what fulfills the
+// promise once it's done.
+typedef IoStatus (*IoCallbackFn)(struct IoWaiter *waiter, ssize_t result, Value *value);
 
-typedef struct EpollData {
+// Socket operation started with `vm_io_start`. The VM runs it once the descriptor is ready with epoll, or submits it
+// to io_uring, and hands the result to the callback.
+typedef struct IoWaiter {
+    struct IoWaiter *next;
+    IoOperation operation;
+    // -1 once the descriptor was closed while the operation was still in the kernel.
     int fd;
-    bool close_fd;
+    // Memory the operation reads into or writes from.
+    char *data;
+    size_t length;
+    IoCallbackFn callback;
     Coroutine *creator;
-    EpollCallbackFn callback;
-    char data[];
-} EpollData;
+    ObjPromise *promise;
+    // Object that owns `data`, kept alive until the operation is done. May be NULL.
+    Object *buffer;
+    // File that IO_SENDFILE reads from `offset`, closed once the operation is done.
+    int file_fd;
+    off_t offset;
+} IoWaiter;
+
+// Operations on a descriptor run one at a time in each direction, in the order they were started. With epoll, the
+// descriptor is registered once, edge-triggered, the first time an operation on it would block. With io_uring, the
+// operations at the head of the queues are the ones submitted to the kernel.
+typedef struct {
+    bool is_registered;
+    // Cleared when an operation would block, set again when epoll reports the descriptor ready.
+    bool is_readable;
+    bool is_writable;
+    IoWaiter *readers_head;
+    IoWaiter *readers_tail;
+    IoWaiter *writers_head;
+    IoWaiter *writers_tail;
+} IoState;
+
+#ifdef INLINE_CACHING
+// Must be a power of two.
+#define METHOD_CACHE_SIZE 1024
 
 typedef struct {
+    cache_id_t class_id;
+    ObjString *name;
+    ObjClosure *method;
+} MethodCacheEntry;
+#endif
+
+typedef struct {
+    // Set before `init_vm` in processes started with `--workers`, servers then share their port with the other workers.
+    bool is_worker;
     Coroutine *active_head;
-    Coroutine *sleeping_head;
+    // Min-heap of sleeping coroutines ordered by their wake up time.
+    Timer *timers;
+    uint32_t timers_length;
+    uint32_t timers_capacity;
     Coroutine *coroutine;
+    // Finished coroutines linked through `next`.
+    Coroutine *pooled_head;
+    uint32_t pooled_count;
+#ifdef IO_URING
+    // Used instead of epoll when the kernel supports it.
+    bool has_uring;
+    Uring uring;
+#endif
     int epoll_fd;
-    uint32_t epoll_count;
+    // IO state of every descriptor that has been used, indexed by the descriptor.
+    IoState *io_states;
+    uint32_t io_states_capacity;
+    uint32_t io_registered_count;
+    // Operations waiting for their descriptor, the program doesn't finish while there are any.
+    uint32_t io_waiting_count;
+    // Scheduler rounds with active coroutines since IO was last checked.
+    uint32_t rounds_since_poll;
     // Set of interned strings (values are always null).
     HashMap strings;
-    HashMap globals;
-    ObjUpvalue *open_upvalues;
+    // Global variable names mapped to their index in `globals`, assigned when the compiler first sees a name.
+    HashMap global_slots;
+    ValueVec globals;
     // Interned strings for comparison.
     ObjString *init_string;
     ObjString *length_string;
+    // Classes of the instances made by `readRequest`.
+    ObjClass *request_class;
+    ObjClass *headers_class;
     // Disabled while initializing VM.
     bool enable_gc;
     Object *objects;
@@ -69,21 +173,40 @@ typedef struct {
     Object **grey_objects;
     size_t allocated;
     size_t next_gc;
+#ifdef INLINE_CACHING
+    // Direct-mapped cache of method lookups shared by all call sites, checked before the class method table.
+    MethodCacheEntry method_cache[METHOD_CACHE_SIZE];
+#endif
+#ifdef DEBUG_INLINE_CACHE_STATS
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+        // Misses at sites with all entries taken.
+        uint64_t megamorphic;
+    } invoke_cache_stats;
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+    } method_cache_stats;
+#endif
 } VM;
 
 extern VM vm;
 
-uint64_t get_time_ms(void);
+uint64_t get_time_ns(void);
 void runtime_error(const char *fmt, ...);
 void stack_push(Value value);
 Value stack_pop(void);
 Value stack_peek(uint32_t distance);
+uint32_t global_slot(ObjString *name);
+ObjString *global_name(uint32_t slot);
 void ll_add_head(Coroutine **head, Coroutine *coroutine);
 Coroutine *ll_remove(Coroutine **head, Coroutine **current);
 void promise_add_coroutine(ObjPromise *promise, Coroutine *coroutine);
 void fulfill_promise(ObjPromise *promise, Value value);
-void *vm_epoll_add(int fd, uint32_t epoll_events, EpollCallbackFn callback, size_t callback_data_size);
-void vm_epoll_delete(EpollData *epoll_data);
+void vm_add_timer(Coroutine *coroutine, uint64_t wake_time_ns);
+bool vm_io_start(const IoWaiter *operation);
+void vm_io_close(int fd);
 InterpretResult schedule_coroutine(void);
 void init_vm(void);
 void free_vm(void);